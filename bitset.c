@@ -33,7 +33,7 @@
 typedef struct _bitset bitset;
 
 struct _bitset {
-    long bits[BS_SIZE / BS_NBITS + 1];
+    unsigned long bits[BS_SIZE / BS_NBITS + 1];
 };
 
 /* 
@@ -41,21 +41,1750 @@ struct _bitset {
  *   `n' is the n-th bit
  *   `p' is a pointer to a `bitset' structure 
  */
-#define BS_SET(n,p)    ((p)->bits[(n) / BS_NBITS] |= (1 << ((n) % BS_NBITS)))
-#define BS_CLR(n,p)    ((p)->bits[(n) / BS_NBITS] &= ~(1 << ((n) % BS_NBITS)))
-#define BS_ISSET(n,p)  ((p)->bits[(n) / BS_NBITS] & (1 << ((n) % BS_NBITS)))
+#define BS_SET(n,p)    ((p)->bits[(n) / BS_NBITS] |= (1UL << ((n) % BS_NBITS)))
+#define BS_CLR(n,p)    ((p)->bits[(n) / BS_NBITS] &= ~(1UL << ((n) % BS_NBITS)))
+#define BS_ISSET(n,p)  ((p)->bits[(n) / BS_NBITS] & (1UL << ((n) % BS_NBITS)))
 #define BS_ZERO(p)     memset((p), '\0', sizeof(bitset))
-a
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of words needed to hold `n' bits. */
+#define BS_NWORDS(n)   (((n) + BS_NBITS - 1) / BS_NBITS)
+
+/* 
+ * Dynamically sized bitset: same word layout as `bitset' but the 
+ * number of bits is chosen at runtime. Bits past `size' in the last 
+ * word are always kept cleared.
+ */
+typedef struct _dbitset dbitset;
+
+struct _dbitset {
+    unsigned long *bits;
+    size_t size;		/* number of bits */
+    size_t nwords;		/* number of words in bits[] */
+};
+
+/* 
+ * dbitset manipulation macros, no bounds checking 
+ *   `n' is the n-th bit
+ *   `p' is a pointer to a `dbitset' structure 
+ */
+#define DBS_SET(n,p)   ((p)->bits[(n) / BS_NBITS] |= (1UL << ((n) % BS_NBITS)))
+#define DBS_CLR(n,p)   ((p)->bits[(n) / BS_NBITS] &= ~(1UL << ((n) % BS_NBITS)))
+#define DBS_ISSET(n,p) ((p)->bits[(n) / BS_NBITS] & (1UL << ((n) % BS_NBITS)))
+#define DBS_ZERO(p)    memset((p)->bits, '\0', (p)->nwords * sizeof(unsigned long))
+
+/* Mask of the valid bits in the last word of a `size' bits set. */
+static unsigned long
+dbs_tailmask(size_t size)
+{
+    return size % BS_NBITS ? (1UL << (size % BS_NBITS)) - 1 : ~0UL;
+}
+
+dbitset *
+dbs_new(size_t size)
+{
+    dbitset *p;
+
+    if ((p = malloc(sizeof(dbitset))) == NULL)
+	return NULL;
+
+    p->size = size;
+    p->nwords = BS_NWORDS(size);
+
+    /* Allocate at least one word so that bits is never NULL. */
+    if ((p->bits = calloc(p->nwords ? p->nwords : 1, 
+			  sizeof(unsigned long))) == NULL) {
+	free(p);
+	return NULL;
+    }
+
+    return p;
+}
+
+void
+dbs_free(dbitset *p)
+{
+    if (p) {
+	free(p->bits);
+	free(p);
+    }
+}
+
+/* 
+ * Change the number of bits of `p' to `size'. New bits are cleared.
+ * Returns 0 on success, -1 (leaving `p' untouched) on failure.
+ */
+int
+dbs_resize(dbitset *p, size_t size)
+{
+    unsigned long *bits;
+    size_t nwords = BS_NWORDS(size);
+
+    if (nwords != p->nwords) {
+	bits = realloc(p->bits, (nwords ? nwords : 1) * sizeof(unsigned long));
+
+	if (bits == NULL)
+	    return -1;
+
+	if (nwords > p->nwords)
+	    memset(bits + p->nwords, '\0', 
+		   (nwords - p->nwords) * sizeof(unsigned long));
+
+	p->bits = bits;
+	p->nwords = nwords;
+    }
+
+    p->size = size;
+
+    /* Drop the bits beyond the new size. */
+    if (nwords)
+	p->bits[nwords - 1] &= dbs_tailmask(size);
+
+    return 0;
+}
+
+/*
+ * Word array kernels. Every set operation and count goes through the 
+ * `bs_kern' table, which is pointed at the widest variant the CPU 
+ * supports (checked through CPUID once, at startup): scalar, SSE4.2 
+ * (128 bit ops and popcnt), AVX2 (256 bit ops and Harley-Seal 
+ * popcount) or AVX-512 (512 bit ops and VPOPCNTDQ).
+ */
+typedef struct _bs_kernels bs_kernels;
+
+struct _bs_kernels {
+    const char *name;
+    void (*intersect)(unsigned long *d, const unsigned long *s, size_t n);
+    void (*unite)(unsigned long *d, const unsigned long *s, size_t n);
+    void (*symdiff)(unsigned long *d, const unsigned long *s, size_t n);
+    void (*diff)(unsigned long *d, const unsigned long *s, size_t n);
+    size_t (*count)(const unsigned long *w, size_t n);
+    size_t (*intersect_count)(const unsigned long *a, const unsigned long *b,
+			      size_t n);
+};
+
+static void
+bs_scalar_intersect(unsigned long *restrict d, const unsigned long *restrict s,
+		    size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	d[i] &= s[i];
+}
+
+static void
+bs_scalar_unite(unsigned long *restrict d, const unsigned long *restrict s,
+		size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	d[i] |= s[i];
+}
+
+static void
+bs_scalar_symdiff(unsigned long *restrict d, const unsigned long *restrict s,
+		  size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	d[i] ^= s[i];
+}
+
+static void
+bs_scalar_diff(unsigned long *restrict d, const unsigned long *restrict s,
+	       size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	d[i] &= ~s[i];
+}
+
+static size_t
+bs_scalar_count(const unsigned long *w, size_t n)
+{
+    size_t i, c = 0;
+
+    for (i = 0; i < n; i++)
+	c += __builtin_popcountl(w[i]);
+
+    return c;
+}
+
+static size_t
+bs_scalar_intersect_count(const unsigned long *a, const unsigned long *b,
+			  size_t n)
+{
+    size_t i, c = 0;
+
+    for (i = 0; i < n; i++)
+	c += __builtin_popcountl(a[i] & b[i]);
+
+    return c;
+}
+
+static const bs_kernels bs_scalar_kernels = {
+    "scalar",
+    bs_scalar_intersect, bs_scalar_unite, bs_scalar_symdiff, bs_scalar_diff,
+    bs_scalar_count, bs_scalar_intersect_count
+};
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* Words per 128, 256 and 512 bit vector. */
+#define BS_W128        (16 / sizeof(unsigned long))
+#define BS_W256        (32 / sizeof(unsigned long))
+#define BS_W512        (64 / sizeof(unsigned long))
+
+/* 
+ * Define a vector kernel `name' for `op': the body loads `d' and `s' 
+ * a vector at a time and leaves the remaining words to `tail'. 
+ */
+#define BS_VECTOR_OP(name, isa, vec, width, load, store, op, tail)	\
+static __attribute__((target(isa))) void				\
+name(unsigned long *d, const unsigned long *s, size_t n)		\
+{									\
+    size_t i;								\
+									\
+    for (i = 0; i + width <= n; i += width)				\
+	store((vec *) (d + i), op(load((const vec *) (d + i)),		\
+				  load((const vec *) (s + i))));	\
+									\
+    tail(d + i, s + i, n - i);						\
+}
+
+/* andnot intrinsics compute ~a & b: swap to get a & ~b. */
+#define BS_ANDNOT128(a, b) _mm_andnot_si128((b), (a))
+#define BS_ANDNOT256(a, b) _mm256_andnot_si256((b), (a))
+#define BS_ANDNOT512(a, b) _mm512_andnot_si512((b), (a))
+
+BS_VECTOR_OP(bs_sse_intersect, "sse4.2", __m128i, BS_W128, _mm_loadu_si128,
+	     _mm_storeu_si128, _mm_and_si128, bs_scalar_intersect)
+BS_VECTOR_OP(bs_sse_unite, "sse4.2", __m128i, BS_W128, _mm_loadu_si128,
+	     _mm_storeu_si128, _mm_or_si128, bs_scalar_unite)
+BS_VECTOR_OP(bs_sse_symdiff, "sse4.2", __m128i, BS_W128, _mm_loadu_si128,
+	     _mm_storeu_si128, _mm_xor_si128, bs_scalar_symdiff)
+BS_VECTOR_OP(bs_sse_diff, "sse4.2", __m128i, BS_W128, _mm_loadu_si128,
+	     _mm_storeu_si128, BS_ANDNOT128, bs_scalar_diff)
+
+/* With the target set, __builtin_popcountl becomes a popcnt instruction. */
+static __attribute__((target("sse4.2,popcnt"))) size_t
+bs_sse_count(const unsigned long *w, size_t n)
+{
+    size_t i, c = 0;
+
+    for (i = 0; i < n; i++)
+	c += __builtin_popcountl(w[i]);
+
+    return c;
+}
+
+static __attribute__((target("sse4.2,popcnt"))) size_t
+bs_sse_intersect_count(const unsigned long *a, const unsigned long *b, 
+		       size_t n)
+{
+    size_t i, c = 0;
+
+    for (i = 0; i < n; i++)
+	c += __builtin_popcountl(a[i] & b[i]);
+
+    return c;
+}
+
+static const bs_kernels bs_sse_kernels = {
+    "sse4.2",
+    bs_sse_intersect, bs_sse_unite, bs_sse_symdiff, bs_sse_diff,
+    bs_sse_count, bs_sse_intersect_count
+};
+
+BS_VECTOR_OP(bs_avx2_intersect, "avx2", __m256i, BS_W256, _mm256_loadu_si256,
+	     _mm256_storeu_si256, _mm256_and_si256, bs_scalar_intersect)
+BS_VECTOR_OP(bs_avx2_unite, "avx2", __m256i, BS_W256, _mm256_loadu_si256,
+	     _mm256_storeu_si256, _mm256_or_si256, bs_scalar_unite)
+BS_VECTOR_OP(bs_avx2_symdiff, "avx2", __m256i, BS_W256, _mm256_loadu_si256,
+	     _mm256_storeu_si256, _mm256_xor_si256, bs_scalar_symdiff)
+BS_VECTOR_OP(bs_avx2_diff, "avx2", __m256i, BS_W256, _mm256_loadu_si256,
+	     _mm256_storeu_si256, BS_ANDNOT256, bs_scalar_diff)
+
+/* 
+ * Per 64 bit lane popcount of a 256 bit vector: nibble table lookup 
+ * with vpshufb, then horizontal byte sums with vpsadbw (Mula).
+ */
+static inline __attribute__((always_inline, target("avx2"))) __m256i
+bs_avx2_popcnt(__m256i v)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 
+					   1, 2, 2, 3, 2, 3, 3, 4,
+					   0, 1, 1, 2, 1, 2, 2, 3, 
+					   1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+
+    return _mm256_sad_epu8(_mm256_add_epi8(_mm256_shuffle_epi8(table, lo),
+					   _mm256_shuffle_epi8(table, hi)),
+			   _mm256_setzero_si256());
+}
+
+/* Carry-save adder: (h, l) = a + b + c, bit-sliced. */
+#define BS_CSA(h, l, a, b, c)						\
+    do {								\
+	__m256i u_ = _mm256_xor_si256((a), (b));			\
+	(h) = _mm256_or_si256(_mm256_and_si256((a), (b)),		\
+			      _mm256_and_si256(u_, (c)));		\
+	(l) = _mm256_xor_si256(u_, (c));				\
+    } while (0)
+
+/* 
+ * Harley-Seal popcount: 16 vectors are reduced through a tree of 
+ * carry-save adders and only the "sixteens" vector is actually 
+ * counted. With `b' non NULL it counts a & b instead (inlined with a 
+ * constant `b', so the test is folded away).
+ */
+static inline __attribute__((always_inline, target("avx2"))) size_t
+bs_avx2_hs(const unsigned long *a, const unsigned long *b, size_t n)
+{
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = total, twos = total, fours = total, eights = total;
+    __m256i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+    __m256i v[16];
+    size_t i, j, c;
+
+    for (i = 0; i + 16 * BS_W256 <= n; i += 16 * BS_W256) {
+	for (j = 0; j < 16; j++) {
+	    v[j] = _mm256_loadu_si256((const __m256i *) (a + i + j * BS_W256));
+	    if (b)
+		v[j] = _mm256_and_si256(v[j], _mm256_loadu_si256(
+		    (const __m256i *) (b + i + j * BS_W256)));
+	}
+
+	BS_CSA(twos_a, ones, ones, v[0], v[1]);
+	BS_CSA(twos_b, ones, ones, v[2], v[3]);
+	BS_CSA(fours_a, twos, twos, twos_a, twos_b);
+	BS_CSA(twos_a, ones, ones, v[4], v[5]);
+	BS_CSA(twos_b, ones, ones, v[6], v[7]);
+	BS_CSA(fours_b, twos, twos, twos_a, twos_b);
+	BS_CSA(eights_a, fours, fours, fours_a, fours_b);
+	BS_CSA(twos_a, ones, ones, v[8], v[9]);
+	BS_CSA(twos_b, ones, ones, v[10], v[11]);
+	BS_CSA(fours_a, twos, twos, twos_a, twos_b);
+	BS_CSA(twos_a, ones, ones, v[12], v[13]);
+	BS_CSA(twos_b, ones, ones, v[14], v[15]);
+	BS_CSA(fours_b, twos, twos, twos_a, twos_b);
+	BS_CSA(eights_b, fours, fours, fours_a, fours_b);
+	BS_CSA(sixteens, eights, eights, eights_a, eights_b);
+
+	total = _mm256_add_epi64(total, bs_avx2_popcnt(sixteens));
+    }
+
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, 
+			     _mm256_slli_epi64(bs_avx2_popcnt(eights), 3));
+    total = _mm256_add_epi64(total, 
+			     _mm256_slli_epi64(bs_avx2_popcnt(fours), 2));
+    total = _mm256_add_epi64(total, 
+			     _mm256_slli_epi64(bs_avx2_popcnt(twos), 1));
+    total = _mm256_add_epi64(total, bs_avx2_popcnt(ones));
+
+    c = (size_t) _mm256_extract_epi64(total, 0) 
+	+ (size_t) _mm256_extract_epi64(total, 1)
+	+ (size_t) _mm256_extract_epi64(total, 2) 
+	+ (size_t) _mm256_extract_epi64(total, 3);
+
+    /* Remaining words. */
+    return c + (b ? bs_sse_intersect_count(a + i, b + i, n - i) 
+		: bs_sse_count(a + i, n - i));
+}
+
+static __attribute__((target("avx2"))) size_t
+bs_avx2_count(const unsigned long *w, size_t n)
+{
+    return bs_avx2_hs(w, NULL, n);
+}
+
+static __attribute__((target("avx2"))) size_t
+bs_avx2_intersect_count(const unsigned long *a, const unsigned long *b,
+			size_t n)
+{
+    return bs_avx2_hs(a, b, n);
+}
+
+static const bs_kernels bs_avx2_kernels = {
+    "avx2",
+    bs_avx2_intersect, bs_avx2_unite, bs_avx2_symdiff, bs_avx2_diff,
+    bs_avx2_count, bs_avx2_intersect_count
+};
+
+#define BS_AVX512      "avx512f,avx512vpopcntdq"
+
+BS_VECTOR_OP(bs_avx512_intersect, BS_AVX512, __m512i, BS_W512, 
+	     _mm512_loadu_si512, _mm512_storeu_si512, _mm512_and_si512, 
+	     bs_scalar_intersect)
+BS_VECTOR_OP(bs_avx512_unite, BS_AVX512, __m512i, BS_W512, 
+	     _mm512_loadu_si512, _mm512_storeu_si512, _mm512_or_si512, 
+	     bs_scalar_unite)
+BS_VECTOR_OP(bs_avx512_symdiff, BS_AVX512, __m512i, BS_W512, 
+	     _mm512_loadu_si512, _mm512_storeu_si512, _mm512_xor_si512, 
+	     bs_scalar_symdiff)
+BS_VECTOR_OP(bs_avx512_diff, BS_AVX512, __m512i, BS_W512, 
+	     _mm512_loadu_si512, _mm512_storeu_si512, BS_ANDNOT512, 
+	     bs_scalar_diff)
+
+static __attribute__((target(BS_AVX512))) size_t
+bs_avx512_count(const unsigned long *w, size_t n)
+{
+    __m512i total = _mm512_setzero_si512();
+    size_t i;
+
+    for (i = 0; i + BS_W512 <= n; i += BS_W512)
+	total = _mm512_add_epi64(total, 
+		    _mm512_popcnt_epi64(_mm512_loadu_si512(w + i)));
+
+    return _mm512_reduce_add_epi64(total) + bs_scalar_count(w + i, n - i);
+}
+
+static __attribute__((target(BS_AVX512))) size_t
+bs_avx512_intersect_count(const unsigned long *a, const unsigned long *b,
+			  size_t n)
+{
+    __m512i total = _mm512_setzero_si512();
+    size_t i;
+
+    for (i = 0; i + BS_W512 <= n; i += BS_W512)
+	total = _mm512_add_epi64(total, 
+		    _mm512_popcnt_epi64(_mm512_and_si512(
+			_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i))));
+
+    return _mm512_reduce_add_epi64(total) 
+	+ bs_scalar_intersect_count(a + i, b + i, n - i);
+}
+
+static const bs_kernels bs_avx512_kernels = {
+    "avx512",
+    bs_avx512_intersect, bs_avx512_unite, bs_avx512_symdiff, bs_avx512_diff,
+    bs_avx512_count, bs_avx512_intersect_count
+};
+#endif /* __x86_64__ */
+
+/* Kernels in use. */
+static const bs_kernels *bs_kern = &bs_scalar_kernels;
+
+/* Pick the widest kernels the CPU supports; run before main(). */
+static void __attribute__((constructor))
+bs_kernels_init(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") 
+	&& __builtin_cpu_supports("avx512vpopcntdq"))
+	bs_kern = &bs_avx512_kernels;
+    else if (__builtin_cpu_supports("avx2"))
+	bs_kern = &bs_avx2_kernels;
+    else if (__builtin_cpu_supports("sse4.2") 
+	     && __builtin_cpu_supports("popcnt"))
+	bs_kern = &bs_sse_kernels;
+#endif
+}
+
+/* 
+ * Whole-set operations, through the kernels above. `dst' is updated 
+ * in place with `src' (i.e. dst &= src, dst |= src, ...); when the 
+ * sizes differ the missing bits of `src' are taken as cleared.
+ */
+#define DBS_MINWORDS(a,b) ((a)->nwords < (b)->nwords ? (a)->nwords : (b)->nwords)
+
+void
+dbs_and(dbitset *dst, const dbitset *src)
+{
+    size_t n = DBS_MINWORDS(dst, src);
+
+    bs_kern->intersect(dst->bits, src->bits, n);
+    memset(dst->bits + n, '\0', (dst->nwords - n) * sizeof(unsigned long));
+}
+
+void
+dbs_or(dbitset *dst, const dbitset *src)
+{
+    size_t n = DBS_MINWORDS(dst, src);
+
+    bs_kern->unite(dst->bits, src->bits, n);
+
+    if (n && n == dst->nwords)
+	dst->bits[n - 1] &= dbs_tailmask(dst->size);
+}
+
+void
+dbs_xor(dbitset *dst, const dbitset *src)
+{
+    size_t n = DBS_MINWORDS(dst, src);
+
+    bs_kern->symdiff(dst->bits, src->bits, n);
+
+    if (n && n == dst->nwords)
+	dst->bits[n - 1] &= dbs_tailmask(dst->size);
+}
+
+void
+dbs_andnot(dbitset *dst, const dbitset *src)
+{
+    bs_kern->diff(dst->bits, src->bits, DBS_MINWORDS(dst, src));
+}
+
+/* |a & b|, without building the intersection. */
+size_t
+dbs_and_count(const dbitset *a, const dbitset *b)
+{
+    return bs_kern->intersect_count(a->bits, b->bits, DBS_MINWORDS(a, b));
+}
+
+void
+dbs_not(dbitset *p)
+{
+    size_t i;
+
+    for (i = 0; i < p->nwords; i++)
+	p->bits[i] = ~p->bits[i];
+
+    if (p->nwords)
+	p->bits[p->nwords - 1] &= dbs_tailmask(p->size);
+}
+
+/*
+ * Counting and scanning. These work on a plain word array so that 
+ * both `bitset' and `dbitset' can share them; the cost is one 
+ * popcount/ctz per word (or per set bit) instead of one test per bit.
+ */
+/* 
+ * Position of the first set (or, if `inv' is ~0UL, clear) bit at or 
+ * after `from'; `size' if there is none.
+ */
+static size_t
+bs_words_next(const unsigned long *w, size_t size, size_t from, 
+	      unsigned long inv)
+{
+    size_t i, n;
+    unsigned long word;
+
+    if (from >= size)
+	return size;
+
+    i = from / BS_NBITS;
+    word = (w[i] ^ inv) & (~0UL << (from % BS_NBITS));
+
+    for (;;) {
+	if (word) {
+	    n = i * BS_NBITS + __builtin_ctzl(word);
+	    return n < size ? n : size;
+	}
+	if (++i >= BS_NWORDS(size))
+	    return size;
+	word = w[i] ^ inv;
+    }
+}
+
+/* Number of set bits. */
+size_t
+bs_count(const bitset *p)
+{
+    return bs_kern->count(p->bits, BS_NWORDS(BS_SIZE));
+}
+
+/* First set bit at or after `n', BS_SIZE if none. */
+size_t
+bs_next_set(const bitset *p, size_t n)
+{
+    return bs_words_next(p->bits, BS_SIZE, n, 0);
+}
+
+/* First clear bit at or after `n', BS_SIZE if none. */
+size_t
+bs_next_clear(const bitset *p, size_t n)
+{
+    return bs_words_next(p->bits, BS_SIZE, n, ~0UL);
+}
+
+size_t
+dbs_count(const dbitset *p)
+{
+    return bs_kern->count(p->bits, p->nwords);
+}
+
+size_t
+dbs_next_set(const dbitset *p, size_t n)
+{
+    return bs_words_next(p->bits, p->size, n, 0);
+}
+
+size_t
+dbs_next_clear(const dbitset *p, size_t n)
+{
+    return bs_words_next(p->bits, p->size, n, ~0UL);
+}
+
+/* 
+ * Set bit iterator. The current word is cached and consumed one bit 
+ * at a time (w &= w - 1), so walking a sparse set touches every word 
+ * once and every set bit once:
+ *
+ *   dbs_iter it;
+ *   size_t n;
+ *
+ *   dbs_iter_init(&it, p);
+ *   while (dbs_iter_next(&it, &n))
+ *       ... bit `n' is set ...
+ */
+typedef struct _dbs_iter dbs_iter;
+
+struct _dbs_iter {
+    const unsigned long *bits;
+    size_t nwords;
+    size_t word;		/* index of the cached word */
+    unsigned long cur;		/* bits of `word' not yet returned */
+};
+
+void
+dbs_iter_init(dbs_iter *it, const dbitset *p)
+{
+    it->bits = p->bits;
+    it->nwords = p->nwords;
+    it->word = 0;
+    it->cur = p->nwords ? p->bits[0] : 0;
+}
+
+/* Store the next set bit in `*n'; returns 0 when the set is exhausted. */
+int
+dbs_iter_next(dbs_iter *it, size_t *n)
+{
+    while (it->cur == 0) {
+	if (++it->word >= it->nwords)
+	    return 0;
+	it->cur = it->bits[it->word];
+    }
+
+    *n = it->word * BS_NBITS + __builtin_ctzl(it->cur);
+    it->cur &= it->cur - 1;
+    return 1;
+}
+
+/* Loop over the set bits of a dbitset `p', `n' being a size_t. */
+#define DBS_FOREACH(n,p) \
+    for ((n) = dbs_next_set((p), 0); (n) < (p)->size;	\
+	 (n) = dbs_next_set((p), (n) + 1))
+
+/*
+ * Compressed bitset over a 2^32 universe, Roaring style. Values are 
+ * grouped by their high 16 bits into chunks of 65536; each non empty 
+ * chunk is stored in a container whose kind depends on its density:
+ *
+ *   - array:  sorted 16 bit values, used up to CBS_ARRAY_MAX values;
+ *   - bitmap: 65536 bits, used above CBS_ARRAY_MAX values;
+ *   - run:    sorted (start, length - 1) pairs, only produced by 
+ *             cbs_optimize() when it is the smallest of the three.
+ *
+ * Run containers are turned back into an array or a bitmap before 
+ * being modified.
+ */
+#include <stdint.h>
+
+#define CBS_ARRAY      0
+#define CBS_BITMAP     1
+#define CBS_RUN        2
+
+#define CBS_CHUNK      65536
+#define CBS_ARRAY_MAX  4096
+#define CBS_WORDS      (CBS_CHUNK / BS_NBITS)
+
+typedef struct _cbs_container cbs_container;
+
+struct _cbs_container {
+    uint16_t key;		/* high 16 bits of the values */
+    int type;			/* CBS_ARRAY, CBS_BITMAP or CBS_RUN */
+    int card;			/* number of values */
+    int n;			/* values (array) or runs (run) in data */
+    int cap;			/* allocated values or runs */
+    void *data;			/* uint16_t[], unsigned long[] or uint16_t[][2] */
+};
+
+typedef struct _cbitset cbitset;
+
+struct _cbitset {
+    cbs_container *c;		/* containers, sorted by key */
+    int n;
+    int cap;
+};
+
+cbitset *
+cbs_new(void)
+{
+    return calloc(1, sizeof(cbitset));
+}
+
+void
+cbs_free(cbitset *p)
+{
+    int i;
+
+    if (p) {
+	for (i = 0; i < p->n; i++)
+	    free(p->c[i].data);
+	free(p->c);
+	free(p);
+    }
+}
+
+/* 
+ * Binary search of `v' in the sorted `a[0..n-1]': its index if found, 
+ * else -(insertion point) - 1.
+ */
+static int
+cbs_search(const uint16_t *a, int n, uint16_t v)
+{
+    int lo = 0, hi = n - 1, mid;
+
+    while (lo <= hi) {
+	mid = (lo + hi) / 2;
+	if (a[mid] < v)
+	    lo = mid + 1;
+	else if (a[mid] > v)
+	    hi = mid - 1;
+	else
+	    return mid;
+    }
+
+    return -lo - 1;
+}
+
+/* Same as cbs_search() on the container keys. */
+static int
+cbs_find(const cbitset *p, uint16_t key)
+{
+    int lo = 0, hi = p->n - 1, mid;
+
+    while (lo <= hi) {
+	mid = (lo + hi) / 2;
+	if (p->c[mid].key < key)
+	    lo = mid + 1;
+	else if (p->c[mid].key > key)
+	    hi = mid - 1;
+	else
+	    return mid;
+    }
+
+    return -lo - 1;
+}
+
+/* Set bits `start' to `end' (inclusive) of the word array `w'. */
+static void
+cbs_set_range(unsigned long *w, unsigned start, unsigned end)
+{
+    unsigned i = start / BS_NBITS, j = end / BS_NBITS;
+    unsigned long first = ~0UL << (start % BS_NBITS);
+    unsigned long last = ~0UL >> (BS_NBITS - 1 - end % BS_NBITS);
+
+    if (i == j) {
+	w[i] |= first & last;
+	return;
+    }
+
+    w[i++] |= first;
+    while (i < j)
+	w[i++] = ~0UL;
+    w[j] |= last;
+}
+
+static int
+cbs_container_test(const cbs_container *c, uint16_t v)
+{
+    const unsigned long *w = c->data;
+    const uint16_t *r;
+    int lo, hi, mid;
+
+    switch (c->type) {
+    case CBS_ARRAY:
+	return cbs_search(c->data, c->n, v) >= 0;
+    case CBS_BITMAP:
+	return (w[v / BS_NBITS] >> (v % BS_NBITS)) & 1;
+    default:
+	/* Last run starting at or before `v'. */
+	r = c->data;
+	lo = 0;
+	hi = c->n - 1;
+	while (lo <= hi) {
+	    mid = (lo + hi) / 2;
+	    if (r[2 * mid] <= v)
+		lo = mid + 1;
+	    else
+		hi = mid - 1;
+	}
+	return hi >= 0 && v - r[2 * hi] <= r[2 * hi + 1];
+    }
+}
+
+/* Store the values of `c' into the cleared word array `w'. */
+static void
+cbs_fill_bitmap(const cbs_container *c, unsigned long *w)
+{
+    const uint16_t *a = c->data;
+    int i;
+
+    switch (c->type) {
+    case CBS_ARRAY:
+	for (i = 0; i < c->n; i++)
+	    w[a[i] / BS_NBITS] |= 1UL << (a[i] % BS_NBITS);
+	break;
+    case CBS_BITMAP:
+	memcpy(w, c->data, CBS_WORDS * sizeof(unsigned long));
+	break;
+    default:
+	for (i = 0; i < c->n; i++)
+	    cbs_set_range(w, a[2 * i], a[2 * i] + a[2 * i + 1]);
+	break;
+    }
+}
+
+/* Store the values of `c' into `a', which has room for c->card values. */
+static void
+cbs_fill_array(const cbs_container *c, uint16_t *a)
+{
+    const uint16_t *r = c->data;
+    const unsigned long *w = c->data;
+    unsigned long word;
+    int i, j, k = 0;
+
+    switch (c->type) {
+    case CBS_ARRAY:
+	memcpy(a, c->data, c->n * sizeof(uint16_t));
+	break;
+    case CBS_BITMAP:
+	for (i = 0; i < (int) CBS_WORDS; i++)
+	    for (word = w[i]; word; word &= word - 1)
+		a[k++] = i * BS_NBITS + __builtin_ctzl(word);
+	break;
+    default:
+	for (i = 0; i < c->n; i++)
+	    for (j = 0; j <= r[2 * i + 1]; j++)
+		a[k++] = r[2 * i] + j;
+	break;
+    }
+}
+
+/* 
+ * Convert `c' to the given type (CBS_ARRAY requires c->card <= 
+ * CBS_ARRAY_MAX). Returns -1 on allocation failure, `c' untouched.
+ */
+static int
+cbs_convert(cbs_container *c, int type)
+{
+    unsigned long *w;
+    uint16_t *a;
+
+    if (c->type == type)
+	return 0;
+
+    if (type == CBS_BITMAP) {
+	if ((w = calloc(CBS_WORDS, sizeof(unsigned long))) == NULL)
+	    return -1;
+	cbs_fill_bitmap(c, w);
+	free(c->data);
+	c->data = w;
+	c->n = c->cap = 0;
+    } else {
+	if ((a = malloc((c->card ? c->card : 1) * sizeof(uint16_t))) == NULL)
+	    return -1;
+	cbs_fill_array(c, a);
+	free(c->data);
+	c->data = a;
+	c->n = c->cap = c->card;
+    }
+
+    c->type = type;
+    return 0;
+}
+
+/* Array or bitmap, whichever fits the cardinality of `c'. */
+#define CBS_BEST(c)    ((c)->card <= CBS_ARRAY_MAX ? CBS_ARRAY : CBS_BITMAP)
+
+/* Drop the container at index `i'. */
+static void
+cbs_remove(cbitset *p, int i)
+{
+    free(p->c[i].data);
+    memmove(p->c + i, p->c + i + 1, (p->n - i - 1) * sizeof(cbs_container));
+    p->n--;
+}
+
+/* Container for `key', created empty (as an array) if missing. */
+static cbs_container *
+cbs_get(cbitset *p, uint16_t key)
+{
+    cbs_container *c;
+    int i = cbs_find(p, key), cap;
+
+    if (i >= 0)
+	return p->c + i;
+
+    i = -i - 1;
+
+    if (p->n == p->cap) {
+	cap = p->cap ? p->cap * 2 : 4;
+	if ((c = realloc(p->c, cap * sizeof(cbs_container))) == NULL)
+	    return NULL;
+	p->c = c;
+	p->cap = cap;
+    }
+
+    memmove(p->c + i + 1, p->c + i, (p->n - i) * sizeof(cbs_container));
+    p->n++;
+
+    c = p->c + i;
+    memset(c, 0, sizeof(cbs_container));
+    c->key = key;
+    c->type = CBS_ARRAY;
+    return c;
+}
+
+/* Set value `x'. Returns 0 on success, -1 on allocation failure. */
+int
+cbs_set(cbitset *p, uint32_t x)
+{
+    cbs_container *c;
+    uint16_t v = x & 0xffff, *a;
+    unsigned long *w;
+    int i;
+
+    if ((c = cbs_get(p, x >> 16)) == NULL)
+	return -1;
+
+    if (c->type == CBS_RUN && cbs_convert(c, CBS_BEST(c)) < 0)
+	return -1;
+
+    if (c->type == CBS_ARRAY) {
+	if ((i = cbs_search(c->data, c->n, v)) >= 0)
+	    return 0;
+
+	if (c->card == CBS_ARRAY_MAX) {
+	    if (cbs_convert(c, CBS_BITMAP) < 0)
+		return -1;
+	} else {
+	    i = -i - 1;
+	    if (c->n == c->cap) {
+		a = realloc(c->data, (c->cap ? c->cap * 2 : 4) * sizeof(uint16_t));
+		if (a == NULL)
+		    return -1;
+		c->data = a;
+		c->cap = c->cap ? c->cap * 2 : 4;
+	    }
+	    a = c->data;
+	    memmove(a + i + 1, a + i, (c->n - i) * sizeof(uint16_t));
+	    a[i] = v;
+	    c->n++;
+	    c->card++;
+	    return 0;
+	}
+    }
+
+    w = c->data;
+    if (!(w[v / BS_NBITS] & (1UL << (v % BS_NBITS)))) {
+	w[v / BS_NBITS] |= 1UL << (v % BS_NBITS);
+	c->card++;
+    }
+
+    return 0;
+}
+
+/* Clear value `x'. Returns 0 on success, -1 on allocation failure. */
+int
+cbs_clear(cbitset *p, uint32_t x)
+{
+    cbs_container *c;
+    uint16_t v = x & 0xffff, *a;
+    unsigned long *w;
+    int i;
+
+    if ((i = cbs_find(p, x >> 16)) < 0)
+	return 0;
+
+    c = p->c + i;
+
+    if (!cbs_container_test(c, v))
+	return 0;
+
+    if (c->type == CBS_RUN && cbs_convert(c, CBS_BEST(c)) < 0)
+	return -1;
+
+    if (c->type == CBS_ARRAY) {
+	a = c->data;
+	i = cbs_search(a, c->n, v);
+	memmove(a + i, a + i + 1, (c->n - i - 1) * sizeof(uint16_t));
+	c->n--;
+    } else {
+	w = c->data;
+	w[v / BS_NBITS] &= ~(1UL << (v % BS_NBITS));
+    }
+    c->card--;
+
+    if (c->card == 0)
+	cbs_remove(p, c - p->c);
+    else if (c->card == CBS_ARRAY_MAX)
+	(void) cbs_convert(c, CBS_ARRAY);	/* stays a bitmap if it fails */
+
+    return 0;
+}
+
+int
+cbs_test(const cbitset *p, uint32_t x)
+{
+    int i = cbs_find(p, x >> 16);
+
+    return i >= 0 && cbs_container_test(p->c + i, x & 0xffff);
+}
+
+/* Number of values. */
+size_t
+cbs_count(const cbitset *p)
+{
+    size_t c = 0;
+    int i;
+
+    for (i = 0; i < p->n; i++)
+	c += p->c[i].card;
+
+    return c;
+}
+
+/* Replace the data of `c' by the bitmap `w', recounting and shrinking it. */
+static int
+cbs_set_bitmap(cbs_container *c, unsigned long *w)
+{
+    free(c->data);
+    c->data = w;
+    c->type = CBS_BITMAP;
+    c->n = c->cap = 0;
+    c->card = bs_kern->count(w, CBS_WORDS);
+
+    return c->card ? cbs_convert(c, CBS_BEST(c)) : 0;
+}
+
+/* d |= s, for containers of the same key. */
+static int
+cbs_container_or(cbs_container *d, const cbs_container *s)
+{
+    unsigned long *w, *t;
+    uint16_t *a, *x = d->data, *y = s->data;
+    int i = 0, j = 0, k = 0;
+
+    if (d->type == CBS_ARRAY && s->type == CBS_ARRAY 
+	&& d->card + s->card <= CBS_ARRAY_MAX) {
+	/* Merge the two sorted arrays. */
+	if ((a = malloc((d->card + s->card) * sizeof(uint16_t))) == NULL)
+	    return -1;
+	while (i < d->n && j < s->n) {
+	    if (x[i] < y[j])
+		a[k++] = x[i++];
+	    else if (x[i] > y[j])
+		a[k++] = y[j++];
+	    else {
+		a[k++] = x[i++];
+		j++;
+	    }
+	}
+	while (i < d->n)
+	    a[k++] = x[i++];
+	while (j < s->n)
+	    a[k++] = y[j++];
+	free(d->data);
+	d->data = a;
+	d->n = d->card = k;
+	d->cap = d->card + s->card;
+	return 0;
+    }
+
+    if ((w = calloc(CBS_WORDS, sizeof(unsigned long))) == NULL)
+	return -1;
+    cbs_fill_bitmap(d, w);
+
+    if (s->type == CBS_BITMAP) {
+	bs_kern->unite(w, s->data, CBS_WORDS);
+    } else {
+	if ((t = calloc(CBS_WORDS, sizeof(unsigned long))) == NULL) {
+	    free(w);
+	    return -1;
+	}
+	cbs_fill_bitmap(s, t);
+	bs_kern->unite(w, t, CBS_WORDS);
+	free(t);
+    }
+
+    return cbs_set_bitmap(d, w);
+}
+
+/* d &= s, for containers of the same key. */
+static int
+cbs_container_and(cbs_container *d, const cbs_container *s)
+{
+    unsigned long *w, *t;
+    uint16_t *a;
+    int i, k = 0;
+
+    if (d->type == CBS_ARRAY) {
+	/* Filter in place. */
+	a = d->data;
+	for (i = 0; i < d->n; i++)
+	    if (cbs_container_test(s, a[i]))
+		a[k++] = a[i];
+	d->n = d->card = k;
+	return 0;
+    }
+
+    if (s->type == CBS_ARRAY) {
+	/* The result is a subset of `s': keep its values found in `d'. */
+	if ((a = malloc((s->card ? s->card : 1) * sizeof(uint16_t))) == NULL)
+	    return -1;
+	for (i = 0; i < s->n; i++)
+	    if (cbs_container_test(d, ((uint16_t *) s->data)[i]))
+		a[k++] = ((uint16_t *) s->data)[i];
+	free(d->data);
+	d->data = a;
+	d->type = CBS_ARRAY;
+	d->n = d->card = d->cap = k;
+	return 0;
+    }
+
+    if ((w = calloc(CBS_WORDS, sizeof(unsigned long))) == NULL)
+	return -1;
+    cbs_fill_bitmap(d, w);
+
+    if (s->type == CBS_BITMAP) {
+	bs_kern->intersect(w, s->data, CBS_WORDS);
+    } else {
+	if ((t = calloc(CBS_WORDS, sizeof(unsigned long))) == NULL) {
+	    free(w);
+	    return -1;
+	}
+	cbs_fill_bitmap(s, t);
+	bs_kern->intersect(w, t, CBS_WORDS);
+	free(t);
+    }
+
+    return cbs_set_bitmap(d, w);
+}
+
+/* Deep copy of `s' into `d'. */
+static int
+cbs_container_copy(cbs_container *d, const cbs_container *s)
+{
+    size_t size;
+
+    switch (s->type) {
+    case CBS_ARRAY:
+	size = s->n * sizeof(uint16_t);
+	break;
+    case CBS_BITMAP:
+	size = CBS_WORDS * sizeof(unsigned long);
+	break;
+    default:
+	size = s->n * 2 * sizeof(uint16_t);
+	break;
+    }
+
+    *d = *s;
+    d->cap = s->n;
+    if ((d->data = malloc(size ? size : 1)) == NULL)
+	return -1;
+    memcpy(d->data, s->data, size);
+    return 0;
+}
+
+/* dst |= src. Returns 0 on success, -1 on allocation failure. */
+int
+cbs_or(cbitset *dst, const cbitset *src)
+{
+    cbs_container *c;
+    int i, j;
+
+    for (j = 0; j < src->n; j++) {
+	i = cbs_find(dst, src->c[j].key);
+
+	if (i >= 0) {
+	    if (cbs_container_or(dst->c + i, src->c + j) < 0)
+		return -1;
+	    continue;
+	}
+
+	if ((c = cbs_get(dst, src->c[j].key)) == NULL)
+	    return -1;
+	if (cbs_container_copy(c, src->c + j) < 0) {
+	    cbs_remove(dst, c - dst->c);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/* dst &= src. Returns 0 on success, -1 on allocation failure. */
+int
+cbs_and(cbitset *dst, const cbitset *src)
+{
+    int i, j;
+
+    for (i = 0; i < dst->n;) {
+	j = cbs_find(src, dst->c[i].key);
+
+	if (j >= 0 && cbs_container_and(dst->c + i, src->c + j) < 0)
+	    return -1;
+
+	if (j < 0 || dst->c[i].card == 0)
+	    cbs_remove(dst, i);
+	else
+	    i++;
+    }
+
+    return 0;
+}
+
+/* 
+ * Turn every container into a run container where that is smaller 
+ * than its array or bitmap form. Best called once a set is built.
+ */
+int
+cbs_optimize(cbitset *p)
+{
+    cbs_container *c;
+    unsigned long *w;
+    uint16_t *r;
+    size_t start, end;
+    int i, k, nruns;
+
+    if ((w = malloc(CBS_WORDS * sizeof(unsigned long))) == NULL)
+	return -1;
+
+    for (i = 0; i < p->n; i++) {
+	c = p->c + i;
+	if (c->type == CBS_RUN)
+	    continue;
+
+	memset(w, 0, CBS_WORDS * sizeof(unsigned long));
+	cbs_fill_bitmap(c, w);
+
+	/* Runs start where a bit is set and the previous one is not. */
+	for (k = nruns = 0; k < (int) CBS_WORDS; k++)
+	    nruns += __builtin_popcountl(w[k] & ~(w[k] << 1 | 
+		(k ? w[k - 1] >> (BS_NBITS - 1) : 0)));
+
+	/* 4 bytes per run against 2 per value or the whole bitmap. */
+	if (nruns * 4 >= (c->type == CBS_ARRAY ? c->card * 2
+			  : (int) (CBS_WORDS * sizeof(unsigned long))))
+	    continue;
+
+	if ((r = malloc(nruns * 2 * sizeof(uint16_t))) == NULL) {
+	    free(w);
+	    return -1;
+	}
+	for (k = 0, start = bs_words_next(w, CBS_CHUNK, 0, 0); start < CBS_CHUNK;
+	     start = bs_words_next(w, CBS_CHUNK, end, 0), k++) {
+	    end = bs_words_next(w, CBS_CHUNK, start, ~0UL);
+	    r[2 * k] = start;
+	    r[2 * k + 1] = end - start - 1;
+	}
+
+	free(c->data);
+	c->data = r;
+	c->type = CBS_RUN;
+	c->n = c->cap = nruns;
+    }
+
+    free(w);
+    return 0;
+}
+
+/* Compressed copy of the dense set `d' (which must be at most 2^32 bits). */
+cbitset *
+cbs_from_dbitset(const dbitset *d)
+{
+    cbitset *p;
+    cbs_container *c;
+    size_t k, first, nwords;
+    int card;
+
+    if ((p = cbs_new()) == NULL)
+	return NULL;
+
+    for (k = 0; k * CBS_CHUNK < d->size; k++) {
+	first = k * CBS_WORDS;
+	nwords = d->nwords - first < CBS_WORDS ? d->nwords - first : CBS_WORDS;
+
+	if ((card = bs_kern->count(d->bits + first, nwords)) == 0)
+	    continue;
+
+	/* Start as a bitmap over the chunk, then shrink if sparse. */
+	if ((c = cbs_get(p, k)) == NULL 
+	    || (c->data = calloc(CBS_WORDS, sizeof(unsigned long))) == NULL) {
+	    cbs_free(p);
+	    return NULL;
+	}
+	memcpy(c->data, d->bits + first, nwords * sizeof(unsigned long));
+	c->type = CBS_BITMAP;
+	c->card = card;
+
+	if (cbs_convert(c, CBS_BEST(c)) < 0) {
+	    cbs_free(p);
+	    return NULL;
+	}
+    }
+
+    return p;
+}
+
+/* Dense copy of `p' holding `size' bits; values past `size' are dropped. */
+dbitset *
+cbs_to_dbitset(const cbitset *p, size_t size)
+{
+    dbitset *d;
+    unsigned long *w;
+    size_t first, nwords;
+    int i;
+
+    if ((d = dbs_new(size)) == NULL)
+	return NULL;
+
+    if ((w = malloc(CBS_WORDS * sizeof(unsigned long))) == NULL) {
+	dbs_free(d);
+	return NULL;
+    }
+
+    for (i = 0; i < p->n; i++) {
+	first = (size_t) p->c[i].key * CBS_WORDS;
+	if (first >= d->nwords)
+	    break;
+	nwords = d->nwords - first < CBS_WORDS ? d->nwords - first : CBS_WORDS;
+
+	memset(w, 0, CBS_WORDS * sizeof(unsigned long));
+	cbs_fill_bitmap(p->c + i, w);
+	memcpy(d->bits + first, w, nwords * sizeof(unsigned long));
+    }
+
+    if (d->nwords)
+	d->bits[d->nwords - 1] &= dbs_tailmask(size);
+
+    free(w);
+    return d;
+}
+
+/*
+ * Concurrent bitset, for slot allocation shared between threads. All 
+ * updates are single atomic read-modify-write operations on a word 
+ * (__atomic builtins), so there is no lock and no lost update. With 
+ * ATBS_PADDED every word sits on its own cache line, so threads working 
+ * on different words never share a line (at the cost of 8 times the 
+ * memory on 64 bit hosts).
+ */
+#define ATBS_PADDED    1
+
+/* Assumed cache line size, in bytes. */
+#ifndef ATBS_CACHELINE
+# define ATBS_CACHELINE 64
+#endif
+
+typedef struct _atbitset atbitset;
+
+struct _atbitset {
+    unsigned long *bits;
+    size_t size;		/* number of bits */
+    size_t nwords;		/* number of words in use */
+    size_t stride;		/* distance between two words, in words */
+};
+
+/* Word holding the `n'-th bit. */
+#define ATBS_WORD(n,p) ((p)->bits + ((n) / BS_NBITS) * (p)->stride)
+#define ATBS_BIT(n)    (1UL << ((n) % BS_NBITS))
+
+atbitset *
+atbs_new(size_t size, int flags)
+{
+    atbitset *p;
+    size_t bytes;
+
+    if ((p = malloc(sizeof(atbitset))) == NULL)
+	return NULL;
+
+    p->size = size;
+    p->nwords = BS_NWORDS(size);
+    p->stride = flags & ATBS_PADDED ? ATBS_CACHELINE / sizeof(unsigned long) : 1;
+
+    /* Cache line aligned, size rounded up as aligned_alloc() requires. */
+    bytes = (p->nwords ? p->nwords : 1) * p->stride * sizeof(unsigned long);
+    bytes = (bytes + ATBS_CACHELINE - 1) / ATBS_CACHELINE * ATBS_CACHELINE;
+
+    if ((p->bits = aligned_alloc(ATBS_CACHELINE, bytes)) == NULL) {
+	free(p);
+	return NULL;
+    }
+    memset(p->bits, '\0', bytes);
+
+    return p;
+}
+
+void
+atbs_free(atbitset *p)
+{
+    if (p) {
+	free(p->bits);
+	free(p);
+    }
+}
+
+int
+atbs_test(const atbitset *p, size_t n)
+{
+    return (__atomic_load_n(ATBS_WORD(n, p), __ATOMIC_ACQUIRE) & ATBS_BIT(n)) != 0;
+}
+
+/* Set the `n'-th bit; returns its previous value. */
+int
+atbs_test_and_set(atbitset *p, size_t n)
+{
+    return (__atomic_fetch_or(ATBS_WORD(n, p), ATBS_BIT(n), 
+			      __ATOMIC_ACQ_REL) & ATBS_BIT(n)) != 0;
+}
+
+/* Clear the `n'-th bit; returns its previous value. */
+int
+atbs_test_and_clear(atbitset *p, size_t n)
+{
+    return (__atomic_fetch_and(ATBS_WORD(n, p), ~ATBS_BIT(n), 
+			       __ATOMIC_ACQ_REL) & ATBS_BIT(n)) != 0;
+}
+
+/* 
+ * Atomically find a clear bit and set it: the "allocate a slot" 
+ * operation. The search starts at the word holding bit `hint' and 
+ * wraps around, so threads passing different hints (e.g. their 
+ * index times size / nthreads) mostly work on different words. 
+ * Returns the claimed bit, or `size' if every bit is set.
+ */
+size_t
+atbs_claim(atbitset *p, size_t hint)
+{
+    unsigned long *word, w, free_bits, last = dbs_tailmask(p->size);
+    size_t i, k, n;
+
+    if (p->nwords == 0)
+	return p->size;
+
+    i = hint < p->size ? hint / BS_NBITS : 0;
+
+    for (k = 0; k < p->nwords; k++, i = i + 1 < p->nwords ? i + 1 : 0) {
+	word = p->bits + i * p->stride;
+	w = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+	for (;;) {
+	    free_bits = ~w & (i == p->nwords - 1 ? last : ~0UL);
+	    if (free_bits == 0)
+		break;
+
+	    n = __builtin_ctzl(free_bits);
+	    /* On failure `w' is reloaded and the next clear bit is tried. */
+	    if (__atomic_compare_exchange_n(word, &w, w | (1UL << n), 1,
+					    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return i * BS_NBITS + n;
+	}
+    }
+
+    return p->size;
+}
+
+/*
+ * Persistent bitset backed by a memory mapped file. The file is a 
+ * 64 byte header followed by the words of the set, so opening it is 
+ * a mmap() and a header check, whatever its size; `set' is a regular 
+ * dbitset pointing into the mapping (except that it must not be 
+ * resized with dbs_resize()).
+ *
+ * The data checksum is updated by mbs_sync() and mbs_close(), and only 
+ * verified on open when MBS_VERIFY is given (that reads the whole 
+ * file). Read-only opens use a shared read-only mapping, so any number 
+ * of processes can share the same pages.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* mbs_open() flags. */
+#define MBS_RDONLY     0
+#define MBS_RDWR       1
+#define MBS_CREATE     2	/* create or truncate, with `size' bits */
+#define MBS_VERIFY     4	/* check the data checksum */
+
+#define MBS_MAGIC      "BSET"
+#define MBS_VERSION    1
+
+typedef struct _mbs_header mbs_header;
+
+struct _mbs_header {
+    char magic[4];		/* MBS_MAGIC */
+    uint16_t version;		/* MBS_VERSION */
+    uint16_t wordsize;		/* sizeof(unsigned long) of the writer */
+    uint64_t size;		/* number of bits */
+    uint64_t hchecksum;		/* of the fields above */
+    uint64_t checksum;		/* of the words, as of the last sync */
+    char pad[32];		/* up to 64 bytes, keeping words aligned */
+};
+
+typedef struct _mbitset mbitset;
+
+struct _mbitset {
+    dbitset set;
+    mbs_header *header;		/* start of the mapping */
+    size_t length;		/* of the mapping */
+    int fd;
+    int flags;
+};
+
+/* FNV-1a style hash, a word (not a byte) at a time. */
+static uint64_t
+mbs_checksum(const void *data, size_t n, size_t wordsize)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL, w;
+    size_t i;
+
+    for (i = 0; i + wordsize <= n; i += wordsize) {
+	w = 0;
+	memcpy(&w, p + i, wordsize);
+	h = (h ^ w) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static uint64_t
+mbs_header_checksum(const mbs_header *h)
+{
+    return mbs_checksum(h, offsetof(mbs_header, hchecksum), 4);
+}
+
+/* 
+ * File length for a set of `size' bits, with its word count in 
+ * `*nwords', or 0 if no such set can exist: BS_NWORDS() would wrap 
+ * around, or the file would not fit in an off_t or in one mapping.
+ */
+static size_t
+mbs_length(uint64_t size, size_t *nwords)
+{
+    uint64_t max = PTRDIFF_MAX, off_max;
+    size_t n;
+
+    off_max = ((uint64_t) 1 << (sizeof(off_t) * 8 - 1)) - 1;
+    if (off_max < max)
+	max = off_max;
+
+    if (size > SIZE_MAX - (BS_NBITS - 1))
+	return 0;
+    n = BS_NWORDS((size_t) size);
+    if (n > (max - sizeof(mbs_header)) / sizeof(unsigned long))
+	return 0;
+
+    *nwords = n;
+    return sizeof(mbs_header) + n * sizeof(unsigned long);
+}
+
+/* 
+ * Open (or, with MBS_CREATE, create) the bitset file `path'. `size' is 
+ * only used with MBS_CREATE. Returns NULL with errno set on failure: 
+ * EINVAL for a file that is not a bitset written with this word size, 
+ * or whose length does not match its size, EBADMSG on checksum 
+ * mismatch. A `size' that cannot be created (EINVAL, or ENOMEM if the 
+ * address space has no room for it) leaves an existing file alone.
+ */
+mbitset *
+mbs_open(const char *path, size_t size, int flags)
+{
+    mbitset *p;
+    mbs_header h;
+    struct stat st;
+    size_t nwords;
+    void *probe;
+    int err, prot;
+
+    if ((p = calloc(1, sizeof(mbitset))) == NULL)
+	return NULL;
+
+    if (flags & MBS_CREATE)
+	flags |= MBS_RDWR;
+    p->flags = flags;
+    p->fd = -1;
+
+    /* O_TRUNC destroys the old file: anything that can fail, first. */
+    if (flags & MBS_CREATE) {
+	if ((p->length = mbs_length(size, &nwords)) == 0) {
+	    errno = EINVAL;
+	    goto fail;
+	}
+	probe = mmap(NULL, p->length, PROT_NONE, 
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (probe == MAP_FAILED)
+	    goto fail;
+	munmap(probe, p->length);
+    }
+
+    p->fd = open(path, flags & MBS_CREATE ? O_RDWR | O_CREAT | O_TRUNC 
+		 : flags & MBS_RDWR ? O_RDWR : O_RDONLY, 0644);
+    if (p->fd == -1)
+	goto fail;
+
+    if (flags & MBS_CREATE) {
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MBS_MAGIC, 4);
+	h.version = MBS_VERSION;
+	h.wordsize = sizeof(unsigned long);
+	h.size = size;
+	h.hchecksum = mbs_header_checksum(&h);
+
+	/* ftruncate() zero fills, so the new set is empty. */
+	if (ftruncate(p->fd, p->length) == -1
+	    || pwrite(p->fd, &h, sizeof(h), 0) != sizeof(h))
+	    goto fail;
+    } else {
+	if (pread(p->fd, &h, sizeof(h), 0) != sizeof(h) 
+	    || memcmp(h.magic, MBS_MAGIC, 4) != 0 
+	    || h.version != MBS_VERSION
+	    || h.wordsize != sizeof(unsigned long)
+	    || h.hchecksum != mbs_header_checksum(&h)) {
+	    errno = EINVAL;
+	    goto fail;
+	}
+    }
+
+    if (fstat(p->fd, &st) == -1)
+	goto fail;
+
+    /* The header is trusted only if the length agrees with it. */
+    if ((p->length = mbs_length(h.size, &nwords)) == 0
+	|| (uint64_t) st.st_size != p->length) {
+	errno = EINVAL;
+	goto fail;
+    }
+    p->set.size = h.size;
+    p->set.nwords = nwords;
+
+    prot = flags & MBS_RDWR ? PROT_READ | PROT_WRITE : PROT_READ;
+    p->header = mmap(NULL, p->length, prot, MAP_SHARED, p->fd, 0);
+    if (p->header == MAP_FAILED) {
+	p->header = NULL;
+	goto fail;
+    }
+    p->set.bits = (unsigned long *) (p->header + 1);
+
+    if (flags & MBS_CREATE) {
+	p->header->checksum = mbs_checksum(p->set.bits, p->set.nwords 
+					   * sizeof(unsigned long), sizeof(unsigned long));
+    } else if ((flags & MBS_VERIFY) 
+	       && p->header->checksum != mbs_checksum(p->set.bits, p->set.nwords 
+			* sizeof(unsigned long), sizeof(unsigned long))) {
+	errno = EBADMSG;
+	goto fail;
+    }
+
+    return p;
+
+fail:
+    err = errno;
+    if (p->header)
+	munmap(p->header, p->length);
+    if (p->fd != -1)
+	close(p->fd);
+    free(p);
+    errno = err;
+    return NULL;
+}
+
+/* 
+ * Update the checksum and flush the mapping to the file; with `async' 
+ * the writeback is only scheduled (MS_ASYNC). No-op for readers. The 
+ * checksum reads the whole set, so each call costs O(size) however 
+ * little has changed: sync at checkpoints, not after every update. 
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int
+mbs_sync(mbitset *p, int async)
+{
+    if (!(p->flags & MBS_RDWR))
+	return 0;
+
+    p->header->checksum = mbs_checksum(p->set.bits, p->set.nwords 
+				       * sizeof(unsigned long), sizeof(unsigned long));
+
+    return msync(p->header, p->length, async ? MS_ASYNC : MS_SYNC);
+}
+
+/* Sync (writers only), unmap and close. Returns 0 or -1 as mbs_sync(). */
+int
+mbs_close(mbitset *p)
+{
+    int ret = mbs_sync(p, 0);
+
+    munmap(p->header, p->length);
+    close(p->fd);
+    free(p);
+    return ret;
+}
+
 /* Test program. */
 #include <stdio.h>
-#include <stdlib.h>
-#include <string.h> 
+#include <pthread.h>
+
+/* Threads and slots per thread of the atbs_claim test. */
+#define ATBS_THREADS   8
+#define ATBS_SLOTS     1000
+
+static atbitset *slots;
+
+/* 
+ * Claim ATBS_SLOTS * 2 slots, releasing every other one right away, 
+ * and return the claims. A claim may transiently find the set full, 
+ * so it is retried.
+ */
+static void *
+atbs_worker(void *arg)
+{
+    size_t i, hint = (size_t) arg * ATBS_SLOTS, *mine;
+
+    mine = malloc(ATBS_SLOTS * 2 * sizeof(size_t));
+    for (i = 0; i < ATBS_SLOTS * 2; i++) {
+	while ((mine[i] = atbs_claim(slots, hint)) == slots->size)
+	    ;
+	if (i % 2 == 0 && !atbs_test_and_clear(slots, mine[i]))
+	    return NULL;
+    }
+
+    return mine;
+}
 
 int
 main(void)
 {
   register int i;
+  int op;
   bitset x;
+  dbitset *d, *e, *f;
+  cbitset *g, *h;
+  pthread_t tid[ATBS_THREADS];
+  void *claimed[ATBS_THREADS];
+  mbitset *mb;
+  char path[] = "/tmp/bitsetXXXXXX";
+  dbs_iter it;
+  size_t n, m, c;
   
   /* Clearing bits. */
   BS_ZERO(&x);
@@ -86,6 +1815,365 @@ main(void)
     }
   }
  
+  /* Testing dbs_new and dbs_resize. */
+  d = dbs_new(BS_SIZE);
+  e = dbs_new(BS_SIZE / 2);
+  if (d == NULL || e == NULL) {
+    printf("test failed (dbs_new).\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < BS_SIZE; i += 3)
+    DBS_SET(i, d);
+  for (i = 0; i < BS_SIZE / 2; i += 2)
+    DBS_SET(i, e);
+
+  if (dbs_resize(e, BS_SIZE) != 0 || DBS_ISSET(BS_SIZE - 1, e)) {
+    printf("test failed (dbs_resize).\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Testing dbs_and, dbs_or, dbs_xor, dbs_andnot and dbs_not. */
+  f = dbs_new(BS_SIZE);
+  for (op = 0; op < 5; op++) {
+    memcpy(f->bits, d->bits, d->nwords * sizeof(unsigned long));
+    switch (op) {
+    case 0: dbs_and(f, e); break;
+    case 1: dbs_or(f, e); break;
+    case 2: dbs_xor(f, e); break;
+    case 3: dbs_andnot(f, e); break;
+    case 4: dbs_not(f); break;
+    }
+    for (i = 0; i < BS_SIZE; i++) {
+      int a = DBS_ISSET(i, d) != 0, b = DBS_ISSET(i, e) != 0, r;
+      switch (op) {
+      case 0: r = a & b; break;
+      case 1: r = a | b; break;
+      case 2: r = a ^ b; break;
+      case 3: r = a & !b; break;
+      default: r = !a; break;
+      }
+      if ((DBS_ISSET(i, f) != 0) != r) {
+	printf("test failed (dbs operation %d, bit %d).\n", op, i);
+	return EXIT_FAILURE;
+      }
+    }
+  }
+
+  dbs_free(d);
+  dbs_free(e);
+  dbs_free(f);
+
+  /* Testing bs_count, bs_next_set and bs_next_clear. */
+  BS_ZERO(&x);
+  for (i = 5; i < BS_SIZE; i += 7)
+    BS_SET(i, &x);
+  if (bs_count(&x) != (BS_SIZE - 5 + 6) / 7 || bs_next_set(&x, 0) != 5
+      || bs_next_set(&x, 6) != 12 || bs_next_clear(&x, 5) != 6
+      || bs_next_set(&x, BS_SIZE) != BS_SIZE) {
+    printf("test failed (bs_count/bs_next_set/bs_next_clear).\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Testing dbs_count, dbs_next_set, dbs_next_clear and dbs_iter. */
+  d = dbs_new(BS_SIZE + 3);
+  dbs_not(d);
+  if (dbs_count(d) != BS_SIZE + 3 || dbs_next_clear(d, 0) != d->size) {
+    printf("test failed (dbs_count/dbs_next_clear).\n");
+    return EXIT_FAILURE;
+  }
+  DBS_ZERO(d);
+  for (i = 1; i < BS_SIZE + 3; i += 61)
+    DBS_SET(i, d);
+  c = 0;
+  m = dbs_next_set(d, 0);
+  dbs_iter_init(&it, d);
+  while (dbs_iter_next(&it, &n)) {
+    if (n != m) {
+      printf("test failed (dbs_iter).\n");
+      return EXIT_FAILURE;
+    }
+    m = dbs_next_set(d, n + 1);
+    c++;
+  }
+  if (c != dbs_count(d)) {
+    printf("test failed (dbs_iter).\n");
+    return EXIT_FAILURE;
+  }
+  c = 0;
+  DBS_FOREACH(n, d)
+    c++;
+  if (c != dbs_count(d)) {
+    printf("test failed (DBS_FOREACH).\n");
+    return EXIT_FAILURE;
+  }
+  dbs_free(d);
+
+  /* Testing every kernel the CPU supports against the scalar ones. */
+  {
+    const bs_kernels *k[4];
+    unsigned long a[1000], b[1000], r1[1000], r2[1000];
+    size_t nk = 0, j, t, w, sizes[] = { 0, 1, 7, 63, 64, 65, 333, 1000 };
+
+    k[nk++] = &bs_scalar_kernels;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+      k[nk++] = &bs_sse_kernels;
+    if (__builtin_cpu_supports("avx2"))
+      k[nk++] = &bs_avx2_kernels;
+    if (__builtin_cpu_supports("avx512f") 
+	&& __builtin_cpu_supports("avx512vpopcntdq"))
+      k[nk++] = &bs_avx512_kernels;
+#endif
+
+    srand(1);
+    for (w = 0; w < 1000; w++) {
+      a[w] = ((unsigned long) rand() << 33) ^ ((unsigned long) rand() << 11) ^ rand();
+      b[w] = ((unsigned long) rand() << 33) ^ ((unsigned long) rand() << 11) ^ rand();
+    }
+
+    for (j = 1; j < nk; j++)
+      for (t = 0; t < sizeof(sizes) / sizeof(sizes[0]); t++) {
+	w = sizes[t];
+	memcpy(r1, a, sizeof(a));
+	memcpy(r2, a, sizeof(a));
+	bs_scalar_kernels.intersect(r1, b, w);
+	k[j]->intersect(r2, b, w);
+	bs_scalar_kernels.unite(r1, b, w);
+	k[j]->unite(r2, b, w);
+	bs_scalar_kernels.diff(r1, a, w / 2);
+	k[j]->diff(r2, a, w / 2);
+	bs_scalar_kernels.symdiff(r1, b, w);
+	k[j]->symdiff(r2, b, w);
+	if (memcmp(r1, r2, sizeof(r1)) != 0
+	    || k[j]->count(a, w) != bs_scalar_kernels.count(a, w)
+	    || k[j]->intersect_count(a, b, w) 
+	       != bs_scalar_kernels.intersect_count(a, b, w)) {
+	  printf("test failed (%s kernels, %lu words).\n", k[j]->name,
+		 (unsigned long) w);
+	  return EXIT_FAILURE;
+	}
+      }
+  }
+
+  /* Testing dbs_and_count. */
+  d = dbs_new(BS_SIZE * 10);
+  e = dbs_new(BS_SIZE * 7);
+  for (i = 0; i < BS_SIZE * 10; i += 3)
+    DBS_SET(i, d);
+  for (i = 0; i < BS_SIZE * 7; i += 5)
+    DBS_SET(i, e);
+  c = dbs_and_count(d, e);
+  dbs_and(d, e);
+  if (c != dbs_count(d) || c != (BS_SIZE * 7 + 14) / 15) {
+    printf("test failed (dbs_and_count).\n");
+    return EXIT_FAILURE;
+  }
+  dbs_free(d);
+  dbs_free(e);
+
+  /* Testing cbs_set, cbs_clear and cbs_test against a dbitset. */
+#define CBS_TEST_SIZE (5 * CBS_CHUNK + 123)
+  d = dbs_new(CBS_TEST_SIZE);
+  e = dbs_new(CBS_TEST_SIZE);
+  g = cbs_new();
+  h = cbs_new();
+  srand(2);
+  for (i = 0; i < 50000; i++) {
+    /* Sparse chunks 0 and 1, dense chunk 2, a long run in chunk 4. */
+    n = (unsigned) rand() % (3 * CBS_CHUNK);
+    if (n >= 2 * CBS_CHUNK || i % 8 == 0) {
+      DBS_SET(n, d);
+      cbs_set(g, n);
+    } else if (i % 8 == 1) {
+      DBS_CLR(n, d);
+      cbs_clear(g, n);
+    }
+    n = (unsigned) rand() % CBS_TEST_SIZE;
+    if ((n < CBS_CHUNK && i % 4 == 0) || n >= 2 * CBS_CHUNK) {
+      DBS_SET(n, e);
+      cbs_set(h, n);
+    }
+  }
+  for (n = 4 * CBS_CHUNK + 100; n < 4 * CBS_CHUNK + 30000; n++) {
+    DBS_SET(n, d);
+    cbs_set(g, n);
+  }
+  if (cbs_count(g) != dbs_count(d) || cbs_count(h) != dbs_count(e)) {
+    printf("test failed (cbs_count).\n");
+    return EXIT_FAILURE;
+  }
+  for (n = 0; n < CBS_TEST_SIZE; n++)
+    if (!cbs_test(g, n) != !DBS_ISSET(n, d)) {
+      printf("test failed (cbs_set/cbs_clear/cbs_test).\n");
+      return EXIT_FAILURE;
+    }
+
+  /* Testing cbs_optimize, cbs_or, cbs_and and the conversions. */
+  for (op = 0; op < 2; op++) {
+    f = cbs_to_dbitset(g, CBS_TEST_SIZE);
+    if (f == NULL || memcmp(f->bits, d->bits, d->nwords * sizeof(unsigned long))) {
+      printf("test failed (cbs_to_dbitset).\n");
+      return EXIT_FAILURE;
+    }
+    dbs_free(f);
+    cbs_optimize(g);
+    cbs_optimize(h);
+  }
+  if (g->c[g->n - 1].type != CBS_RUN) {
+    printf("test failed (cbs_optimize).\n");
+    return EXIT_FAILURE;
+  }
+  cbs_or(g, h);
+  dbs_or(d, e);
+  cbs_clear(g, 4 * CBS_CHUNK + 200);
+  DBS_CLR(4 * CBS_CHUNK + 200, d);
+  f = cbs_to_dbitset(g, CBS_TEST_SIZE);
+  if (memcmp(f->bits, d->bits, d->nwords * sizeof(unsigned long))) {
+    printf("test failed (cbs_or).\n");
+    return EXIT_FAILURE;
+  }
+  dbs_free(f);
+  cbs_free(h);
+  h = cbs_from_dbitset(e);
+  cbs_and(g, h);
+  dbs_and(d, e);
+  f = cbs_to_dbitset(g, CBS_TEST_SIZE);
+  if (cbs_count(g) != dbs_count(d)
+      || memcmp(f->bits, d->bits, d->nwords * sizeof(unsigned long))) {
+    printf("test failed (cbs_and/cbs_from_dbitset).\n");
+    return EXIT_FAILURE;
+  }
+  dbs_free(d);
+  dbs_free(e);
+  dbs_free(f);
+  cbs_free(g);
+  cbs_free(h);
+
+  /* Testing atbs_claim and atbs_test_and_clear from several threads. */
+  for (op = 0; op < 2; op++) {
+    slots = atbs_new(ATBS_THREADS * ATBS_SLOTS, op ? ATBS_PADDED : 0);
+    for (i = 0; i < ATBS_THREADS; i++)
+      pthread_create(tid + i, NULL, atbs_worker, (void *) (size_t) i);
+    for (i = 0; i < ATBS_THREADS; i++)
+      pthread_join(tid[i], claimed + i);
+
+    /* Every slot claimed exactly once (the even claims were released). */
+    d = dbs_new(slots->size);
+    for (i = 0; i < ATBS_THREADS; i++) {
+      if (claimed[i] == NULL) {
+	printf("test failed (atbs_test_and_clear).\n");
+	return EXIT_FAILURE;
+      }
+      for (n = 1; n < ATBS_SLOTS * 2; n += 2) {
+	m = ((size_t *) claimed[i])[n];
+	if (m >= slots->size || DBS_ISSET(m, d) || !atbs_test(slots, m)) {
+	  printf("test failed (atbs_claim).\n");
+	  return EXIT_FAILURE;
+	}
+	DBS_SET(m, d);
+      }
+      free(claimed[i]);
+    }
+    if (atbs_claim(slots, 0) != slots->size) {
+      printf("test failed (atbs_claim on a full set).\n");
+      return EXIT_FAILURE;
+    }
+    dbs_free(d);
+    atbs_free(slots);
+  }
+
+  /* Testing mbs_open, mbs_sync and mbs_close. */
+  close(mkstemp(path));
+  mb = mbs_open(path, BS_SIZE * 100 + 1, MBS_CREATE);
+  if (mb == NULL || mb->set.size != BS_SIZE * 100 + 1 || dbs_count(&mb->set)) {
+    printf("test failed (mbs_open, MBS_CREATE).\n");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < BS_SIZE * 100 + 1; i += 11)
+    DBS_SET(i, &mb->set);
+  c = dbs_count(&mb->set);
+  if (mbs_close(mb) != 0) {
+    printf("test failed (mbs_close).\n");
+    return EXIT_FAILURE;
+  }
+  mb = mbs_open(path, 0, MBS_RDONLY | MBS_VERIFY);
+  if (mb == NULL || mb->set.size != BS_SIZE * 100 + 1 
+      || dbs_count(&mb->set) != c || !DBS_ISSET(BS_SIZE * 100 - 1, &mb->set)) {
+    printf("test failed (mbs_open, MBS_RDONLY).\n");
+    return EXIT_FAILURE;
+  }
+  mbs_close(mb);
+
+  /* A change behind its back must fail MBS_VERIFY (only). */
+  {
+    int fd = open(path, O_WRONLY);
+    unsigned long w = 1;
+
+    if (pwrite(fd, &w, sizeof(w), sizeof(mbs_header) + sizeof(w)) != sizeof(w)) {
+      printf("test failed (pwrite).\n");
+      return EXIT_FAILURE;
+    }
+    close(fd);
+  }
+  if (mbs_open(path, 0, MBS_RDONLY | MBS_VERIFY) != NULL || errno != EBADMSG
+      || (mb = mbs_open(path, 0, MBS_RDWR)) == NULL) {
+    printf("test failed (mbs_open, MBS_VERIFY).\n");
+    return EXIT_FAILURE;
+  }
+  mbs_close(mb);
+  if ((mb = mbs_open(path, 0, MBS_RDONLY | MBS_VERIFY)) == NULL) {
+    printf("test failed (mbs_sync).\n");
+    return EXIT_FAILURE;
+  }
+  mbs_close(mb);
+
+  /* A size whose word count wraps, or any length mismatch, is rejected. */
+  {
+    int fd = open(path, O_RDWR);
+    struct stat st, st2;
+    mbs_header h;
+
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+      printf("test failed (pread).\n");
+      return EXIT_FAILURE;
+    }
+    h.size = UINT64_MAX - 1;
+    h.hchecksum = mbs_header_checksum(&h);
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)
+        || mbs_open(path, 0, MBS_RDONLY) != NULL || errno != EINVAL) {
+      printf("test failed (mbs_open, size overflow).\n");
+      return EXIT_FAILURE;
+    }
+    h.size = BS_SIZE * 100 + 1;
+    h.hchecksum = mbs_header_checksum(&h);
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)
+        || (mb = mbs_open(path, 0, MBS_RDONLY)) == NULL) {
+      printf("test failed (mbs_open, size restored).\n");
+      return EXIT_FAILURE;
+    }
+    mbs_close(mb);
+
+    /* Rejected before O_TRUNC: the file must survive. */
+    if (fstat(fd, &st) == -1
+        || mbs_open(path, SIZE_MAX, MBS_CREATE) != NULL || errno != EINVAL
+        || fstat(fd, &st2) == -1 || st2.st_size != st.st_size
+        || (mb = mbs_open(path, 0, MBS_RDONLY | MBS_VERIFY)) == NULL
+        || mb->set.size != BS_SIZE * 100 + 1) {
+      printf("test failed (mbs_open, MBS_CREATE overflow).\n");
+      return EXIT_FAILURE;
+    }
+    mbs_close(mb);
+
+    if (ftruncate(fd, st.st_size + sizeof(unsigned long)) == -1
+        || mbs_open(path, 0, MBS_RDONLY) != NULL || errno != EINVAL) {
+      printf("test failed (mbs_open, length mismatch).\n");
+      return EXIT_FAILURE;
+    }
+    close(fd);
+  }
+  unlink(path);
+
   /* All tests was successful. */ 
   printf("test ok.\n");
   return EXIT_SUCCESS;
@@ -69,21 +69,678 @@
  * 
  */
 
+/*
+ * Lanciare processi senza fork()
+ * -------------------------------
+ *
+ * fork() copia (in modo "virtuale", copy-on-write) lo spazio di 
+ * indirizzamento del padre: per un processo con molta memoria residente
+ * la sola copia delle tabelle delle pagine costa millisecondi, e subito 
+ * dopo exec() la butta via. Esistono due alternative:
+ *
+ * - posix_spawn(), che crea il processo ed esegue il programma in una 
+ *   sola chiamata; le modifiche ai descrittori si descrivono prima con 
+ *   le "file actions";
+ *
+ * - clone(CLONE_VM | CLONE_VFORK), cioe' vfork(): il figlio condivide la 
+ *   memoria del padre (nessuna copia), e il padre resta sospeso finche'
+ *   il figlio non chiama exec() o _exit(). Il figlio puo' solo chiamare
+ *   funzioni semplici (dup2(), close(), open(), execve()) e non deve 
+ *   ritornare dalla funzione in cui e' nato.
+ *
+ * La funzione spawn() offre i tre metodi (piu' fork() + exec(), per 
+ * confronto) con le stesse azioni sui descrittori; "exec bench" ne 
+ * misura il costo.
+ *
+ *
+ * Comandi in parallelo
+ * --------------------
+ *
+ * "exec run [-P N] [-o]" si comporta come "xargs -P N": legge da stdin 
+ * un comando per riga, ne esegue al piu' N insieme con /bin/sh e ne 
+ * cattura stdout e stderr su due pipe. L'uscita di ogni comando e' 
+ * tenuta in memoria e stampata tutta insieme quando il comando finisce 
+ * (oppure, con -o, nell'ordine dei comandi), seguita da una riga con 
+ * lo stato, il tempo trascorso e le risorse usate (da wait4()).
+ *
+ * Un solo poll() attende sia le pipe sia la terminazione dei figli: 
+ * il gestore di SIGCHLD scrive un byte su una pipe (la "self-pipe"), 
+ * e solo allora si chiama wait4() senza bloccarsi.
+ */
+
+#define _GNU_SOURCE		/* per clone() */
 #include <stdio.h>
 #include <stdlib.h>		/* per exit() */
 #include <unistd.h>		/* per fork(), getpid(), getppid() */
 #include <string.h>		/* per strerror() */
 #include <errno.h>		/* per errno */
+#include <fcntl.h>		/* per open() */
+#include <sched.h>		/* per clone() */
+#include <signal.h>		/* per sigprocmask() */
+#include <spawn.h>		/* per posix_spawn() */
+#include <time.h>		/* per clock_gettime() */
+#include <poll.h>		/* per poll() */
 #include <sys/types.h>		/* per pid_t */
+#include <sys/resource.h>	/* per struct rusage */
 #include <sys/wait.h>		/* per wait() */
 
+extern char **environ;
+
+/* Azioni sui descrittori del figlio, eseguite in ordine prima di exec() */
+#define SPAWN_DUP2     0	/* dup2(src, fd) */
+#define SPAWN_CLOSE    1	/* close(fd) */
+#define SPAWN_OPEN     2	/* fd = open(path, flags, mode) */
+
+typedef struct _spawn_action spawn_action;
+
+struct _spawn_action {
+    int op;
+    int fd;			/* descrittore del figlio */
+    int src;			/* SPAWN_DUP2 */
+    const char *path;		/* SPAWN_OPEN */
+    int flags;
+    mode_t mode;
+};
+
+/* Metodo di creazione del processo */
+#define SPAWN_FORK     0	/* fork() + execve() */
+#define SPAWN_POSIX    1	/* posix_spawn() */
+#define SPAWN_VFORK    2	/* clone(CLONE_VM | CLONE_VFORK) + execve() */
+
+/* Stack del figlio di clone(): gli basta poco, esegue solo execve() */
+#define SPAWN_STACK    (64 * 1024)
+
+/* Esegue le azioni nel figlio; ritorna -1 al primo errore. */
+static int
+spawn_apply(const spawn_action *act, int nact)
+{
+    int i, fd;
+
+    for (i = 0; i < nact; i++) {
+	switch (act[i].op) {
+	case SPAWN_DUP2:
+	    if (dup2(act[i].src, act[i].fd) == -1)
+		return -1;
+	    break;
+	case SPAWN_CLOSE:
+	    close(act[i].fd);
+	    break;
+	case SPAWN_OPEN:
+	    if ((fd = open(act[i].path, act[i].flags, act[i].mode)) == -1)
+		return -1;
+	    if (fd != act[i].fd) {
+		if (dup2(fd, act[i].fd) == -1)
+		    return -1;
+		close(fd);
+	    }
+	    break;
+	}
+    }
+
+    return 0;
+}
+
+/* Argomenti del figlio di clone(), nella memoria (condivisa) del padre */
+typedef struct _spawn_args spawn_args;
+
+struct _spawn_args {
+    const char *path;
+    char *const *argv;
+    char *const *envp;
+    const spawn_action *act;
+    int nact;
+    sigset_t mask;		/* maschera dei segnali del padre */
+    int err;			/* errno del figlio se exec() fallisce */
+};
+
+static int
+spawn_child(void *arg)
+{
+    spawn_args *a = arg;
+    struct sigaction sa;
+    int sig;
+
+    /* 
+     * I gestori dei segnali sono del padre (e la sua memoria e' 
+     * condivisa): si riportano al default prima di sbloccare i segnali.
+     */
+    memset(&sa, 0, sizeof(sa));
+    for (sig = 1; sig < NSIG; sig++)
+	if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler != SIG_IGN
+	    && sa.sa_handler != SIG_DFL) {
+	    sa.sa_handler = SIG_DFL;
+	    sigaction(sig, &sa, NULL);
+	}
+    sigprocmask(SIG_SETMASK, &a->mask, NULL);
+
+    if (spawn_apply(a->act, a->nact) == 0)
+	execve(a->path, a->argv, a->envp);
+
+    /* Il padre riprende solo dopo _exit(): trovera' l'errore in a->err */
+    a->err = errno;
+    _exit(127);
+}
+
+static pid_t
+spawn_vfork(spawn_args *a)
+{
+    sigset_t all;
+    char *stack;
+    pid_t pid;
+
+    if ((stack = malloc(SPAWN_STACK)) == NULL)
+	return -1;
+
+    /* Nessun gestore del padre deve girare sullo stack del figlio */
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &a->mask);
+
+    a->err = 0;
+    pid = clone(spawn_child, stack + SPAWN_STACK, 
+		CLONE_VM | CLONE_VFORK | SIGCHLD, a);
+
+    sigprocmask(SIG_SETMASK, &a->mask, NULL);
+    free(stack);
+
+    if (pid != -1 && a->err) {
+	waitpid(pid, NULL, 0);
+	errno = a->err;
+	return -1;
+    }
+
+    return pid;
+}
+
+static pid_t
+spawn_posix(spawn_args *a)
+{
+    posix_spawn_file_actions_t fa;
+    pid_t pid;
+    int i, r = 0;
+
+    if ((r = posix_spawn_file_actions_init(&fa)) != 0) {
+	errno = r;
+	return -1;
+    }
+
+    for (i = 0; i < a->nact && r == 0; i++) {
+	switch (a->act[i].op) {
+	case SPAWN_DUP2:
+	    r = posix_spawn_file_actions_adddup2(&fa, a->act[i].src, 
+						 a->act[i].fd);
+	    break;
+	case SPAWN_CLOSE:
+	    r = posix_spawn_file_actions_addclose(&fa, a->act[i].fd);
+	    break;
+	case SPAWN_OPEN:
+	    r = posix_spawn_file_actions_addopen(&fa, a->act[i].fd, 
+						 a->act[i].path, 
+						 a->act[i].flags, 
+						 a->act[i].mode);
+	    break;
+	}
+    }
+
+    if (r == 0)
+	r = posix_spawn(&pid, a->path, &fa, NULL, a->argv, a->envp);
+
+    posix_spawn_file_actions_destroy(&fa);
+    if (r != 0) {
+	errno = r;
+	return -1;
+    }
+
+    return pid;
+}
+
+static pid_t
+spawn_fork(spawn_args *a)
+{
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+	if (spawn_apply(a->act, a->nact) == 0)
+	    execve(a->path, a->argv, a->envp);
+	_exit(127);
+    }
+
+    return pid;
+}
+
+/* 
+ * Lancia il programma `path' con gli argomenti `argv' e l'ambiente 
+ * `envp' (NULL per quello corrente), dopo aver eseguito le `nact' 
+ * azioni `act' sui descrittori del figlio. `how' e' uno dei metodi 
+ * SPAWN_*. Ritorna il PID del figlio, da attendere con wait(), oppure 
+ * -1 (con errno) se il processo non e' stato creato o, con SPAWN_POSIX 
+ * e SPAWN_VFORK, se exec() e' fallita.
+ */
+pid_t
+spawn(const char *path, char *const argv[], char *const envp[], 
+      const spawn_action *act, int nact, int how)
+{
+    spawn_args a;
+
+    a.path = path;
+    a.argv = argv;
+    a.envp = envp ? envp : environ;
+    a.act = act;
+    a.nact = nact;
+
+    switch (how) {
+    case SPAWN_POSIX:
+	return spawn_posix(&a);
+    case SPAWN_VFORK:
+	return spawn_vfork(&a);
+    default:
+	return spawn_fork(&a);
+    }
+}
+
+static double
+spawn_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 
+ * "exec bench [N [MB]]": lancia N volte /bin/true con ogni metodo, 
+ * dopo aver occupato MB megabyte di memoria (per simulare un padre 
+ * grande), e stampa il tempo medio di un lancio (fino a wait()).
+ */
+static int
+spawn_bench(int n, long mb)
+{
+    static const char *name[] = { "fork+exec", "posix_spawn", "vfork" };
+    static char *argv[] = { "true", NULL };
+    spawn_action act[] = {
+	{ SPAWN_OPEN, 1, 0, "/dev/null", O_WRONLY, 0 },
+    };
+    size_t size = (size_t) mb << 20;
+    char *mem = NULL;
+    double t;
+    int how, i;
+
+    /* La memoria va toccata, altrimenti non ci sono pagine da copiare */
+    if (size && (mem = malloc(size)) != NULL)
+	memset(mem, 1, size);
+
+    printf("%d spawns of /bin/true, %ld MB resident\n", n, mem ? mb : 0L);
+
+    for (how = SPAWN_FORK; how <= SPAWN_VFORK; how++) {
+	t = spawn_now();
+	for (i = 0; i < n; i++) {
+	    pid_t pid = spawn("/bin/true", argv, NULL, act, 1, how);
+
+	    if (pid == -1) {
+		fprintf(stderr, "%s: spawn()\n", strerror(errno));
+		return 1;
+	    }
+	    waitpid(pid, NULL, 0);
+	}
+	t = spawn_now() - t;
+	printf("%-12s %8.1f us/spawn\n", name[how], t / n * 1e6);
+    }
+
+    free(mem);
+    return 0;
+}
+
+/* Un comando di "exec run" */
+typedef struct _job job;
+
+struct _job {
+    int id;			/* posizione nell'input */
+    pid_t pid;			/* 0 dopo wait4() */
+    int fd[3];			/* fd[1], fd[2]: pipe, -1 se chiuse */
+    char *buf[3];		/* uscita catturata */
+    size_t len[3];
+    size_t size[3];
+    double start;
+    double wall;
+    int status;
+    struct rusage ru;
+};
+
+/* Capo di scrittura della self-pipe */
+static int job_sigfd = -1;
+
+static void
+job_sigchld(int sig)
+{
+    int e = errno;
+
+    (void) sig;
+    write(job_sigfd, "", 1);
+    errno = e;
+}
+
+static job *
+job_start(const char *cmd, int id)
+{
+    int out[2] = { -1, -1 }, err[2] = { -1, -1 }, i;
+    char *argv[] = { "sh", "-c", (char *) cmd, NULL };
+    job *j;
+
+    if ((j = calloc(1, sizeof(job))) == NULL)
+	return NULL;
+    j->id = id;
+
+    if (pipe2(out, O_CLOEXEC) == 0 && pipe2(err, O_CLOEXEC) == 0) {
+	spawn_action act[] = {
+	    { SPAWN_OPEN, 0, 0, "/dev/null", O_RDONLY, 0 },
+	    { SPAWN_DUP2, 1, out[1], NULL, 0, 0 },
+	    { SPAWN_DUP2, 2, err[1], NULL, 0, 0 },
+	};
+
+	j->start = spawn_now();
+	j->pid = spawn("/bin/sh", argv, NULL, act, 3, SPAWN_POSIX);
+    }
+
+    /* I capi di scrittura sono ormai del figlio */
+    for (i = 0; i < 2; i++) {
+	if (out[i] != -1 && (i == 1 || j->pid <= 0))
+	    close(out[i]);
+	if (err[i] != -1 && (i == 1 || j->pid <= 0))
+	    close(err[i]);
+    }
+
+    if (j->pid <= 0) {
+	free(j);
+	return NULL;
+    }
+
+    j->fd[1] = out[0];
+    j->fd[2] = err[0];
+    return j;
+}
+
+/* Legge quanto disponibile dalla pipe `k' di `j'. */
+static void
+job_read(job *j, int k)
+{
+    ssize_t n;
+    char *p;
+
+    if (j->size[k] - j->len[k] < 4096) {
+	size_t size = j->size[k] ? j->size[k] * 2 : 8192;
+
+	if ((p = realloc(j->buf[k], size)) == NULL) {
+	    /* Senza memoria l'uscita si perde, ma la pipe va svuotata */
+	    char tmp[4096];
+
+	    if (read(j->fd[k], tmp, sizeof(tmp)) > 0)
+		return;
+	    close(j->fd[k]);
+	    j->fd[k] = -1;
+	    return;
+	}
+	j->buf[k] = p;
+	j->size[k] = size;
+    }
+
+    n = read(j->fd[k], j->buf[k] + j->len[k], j->size[k] - j->len[k]);
+    if (n > 0) {
+	j->len[k] += n;
+    } else if (n == 0 || errno != EINTR) {
+	close(j->fd[k]);
+	j->fd[k] = -1;
+    }
+}
+
+static void
+job_free(job *j)
+{
+    free(j->buf[1]);
+    free(j->buf[2]);
+    free(j);
+}
+
+/* Stampa l'uscita e il resoconto di `j', poi lo libera. */
+static void
+job_emit(job *j, const char *cmd)
+{
+    fflush(stdout);
+    fwrite(j->buf[1], 1, j->len[1], stdout);
+    fflush(stdout);
+    fwrite(j->buf[2], 1, j->len[2], stderr);
+
+    fprintf(stderr, "[%d] %s: ", j->id, cmd);
+    if (WIFEXITED(j->status))
+	fprintf(stderr, "$? = %d", WEXITSTATUS(j->status));
+    else if (WIFSIGNALED(j->status))
+	fprintf(stderr, "signal %d%s", WTERMSIG(j->status), 
+		WCOREDUMP(j->status) ? " (core)" : "");
+    fprintf(stderr, ", %.3fs wall, %.3fs user, %.3fs sys, %ld KB\n", 
+	    j->wall, j->ru.ru_utime.tv_sec + j->ru.ru_utime.tv_usec / 1e6,
+	    j->ru.ru_stime.tv_sec + j->ru.ru_stime.tv_usec / 1e6,
+	    j->ru.ru_maxrss);
+
+    job_free(j);
+}
+
+/* 
+ * Esegue i comandi letti da `in', al piu' `max' insieme, nell'ordine 
+ * di fine o (se `ordered') in quello di lettura. Ritorna 123 (come 
+ * xargs) se un comando e' fallito, 1 in caso di errore (anche un 
+ * comando che non si avvia), 0 altrimenti. Dopo un errore non si 
+ * leggono altri comandi, ma si attendono quelli in esecuzione.
+ */
+static int
+run_jobs(FILE *in, int max, int ordered)
+{
+    job **run, **done = NULL, *j;
+    char **cmd = NULL, *line = NULL, c[64];
+    size_t cap = 0, ncmd = 0, next = 0, size = 0;
+    int sp[2], nrun = 0, eof = 0, failed = 0, error = 0, i, k, n;
+    struct pollfd *pfd;
+    struct sigaction sa, old;
+    struct rusage ru;
+    ssize_t len;
+    pid_t pid;
+
+    run = calloc(max, sizeof(job *));
+    pfd = calloc(2 * max + 1, sizeof(struct pollfd));
+    if (run == NULL || pfd == NULL || pipe2(sp, O_CLOEXEC | O_NONBLOCK) == -1) {
+	free(run);
+	free(pfd);
+	return 1;
+    }
+
+    job_sigfd = sp[1];
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = job_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, &old);
+
+    while (!eof || nrun > 0) {
+	/* Nuovi comandi, fino al limite */
+	while (!eof && nrun < max) {
+	    if ((len = getline(&line, &size, in)) == -1) {
+		eof = 1;
+		break;
+	    }
+	    if (len > 0 && line[len - 1] == '\n')
+		line[--len] = '\0';
+	    if (len == 0)
+		continue;
+
+	    if (ncmd == cap) {
+		size_t ncap = cap ? cap * 2 : 64;
+		char **ncmdv;
+		job **ndone;
+
+		/* I vecchi vettori restano validi per i comandi avviati */
+		if ((ncmdv = realloc(cmd, ncap * sizeof(char *))) != NULL)
+		    cmd = ncmdv;
+		if ((ndone = realloc(done, ncap * sizeof(job *))) != NULL)
+		    done = ndone;
+		if (ncmdv == NULL || ndone == NULL) {
+		    fprintf(stderr, "%s: realloc()\n", strerror(errno));
+		    error = eof = 1;
+		    break;
+		}
+		cap = ncap;
+	    }
+	    if ((cmd[ncmd] = strdup(line)) == NULL) {
+		fprintf(stderr, "%s: strdup()\n", strerror(errno));
+		error = eof = 1;
+		break;
+	    }
+	    done[ncmd] = NULL;
+
+	    if ((j = job_start(line, ncmd)) == NULL) {
+		fprintf(stderr, "%s: spawn(): %s\n", strerror(errno), line);
+		error = 1;
+		free(cmd[ncmd]);
+		cmd[ncmd] = NULL;
+		/* Resta un buco nell'ordine: si salta */
+		if (next == ncmd)
+		    next++;
+		ncmd++;
+		continue;
+	    }
+	    ncmd++;
+
+	    for (i = 0; run[i]; i++)
+		;
+	    run[i] = j;
+	    nrun++;
+	}
+
+	if (nrun == 0)
+	    continue;
+
+	/* Un solo punto di attesa: la self-pipe e le pipe dei comandi */
+	pfd[0].fd = sp[0];
+	pfd[0].events = POLLIN;
+	for (i = 0, n = 1; i < max; i++)
+	    for (k = 1; k <= 2; k++) {
+		pfd[n].fd = run[i] ? run[i]->fd[k] : -1;
+		pfd[n++].events = POLLIN;
+	    }
+
+	if (poll(pfd, n, -1) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "%s: poll()\n", strerror(errno));
+	    error = 1;
+	    break;
+	}
+
+	for (i = 0, n = 1; i < max; i++)
+	    for (k = 1; k <= 2; k++, n++)
+		if (pfd[n].fd != -1 && pfd[n].revents)
+		    job_read(run[i], k);
+
+	if (pfd[0].revents) {
+	    while (read(sp[0], c, sizeof(c)) > 0)
+		;
+	    while ((pid = wait4(-1, &k, WNOHANG, &ru)) > 0)
+		for (i = 0; i < max; i++)
+		    if (run[i] && run[i]->pid == pid) {
+			run[i]->pid = 0;
+			run[i]->status = k;
+			run[i]->ru = ru;
+			run[i]->wall = spawn_now() - run[i]->start;
+			break;
+		    }
+	}
+
+	/* Conclusi: terminati e con le pipe chiuse */
+	for (i = 0; i < max; i++) {
+	    j = run[i];
+	    if (j == NULL || j->pid || j->fd[1] != -1 || j->fd[2] != -1)
+		continue;
+
+	    run[i] = NULL;
+	    nrun--;
+	    failed |= !WIFEXITED(j->status) || WEXITSTATUS(j->status);
+
+	    if (!ordered) {
+		k = j->id;
+		job_emit(j, cmd[k]);
+		free(cmd[k]);
+		cmd[k] = NULL;
+		continue;
+	    }
+
+	    done[j->id] = j;
+	    for (; next < ncmd && (done[next] || cmd[next] == NULL); next++)
+		if (done[next]) {
+		    job_emit(done[next], cmd[next]);
+		    free(cmd[next]);
+		    cmd[next] = NULL;
+		}
+	}
+    }
+
+    /* Il chiamante ritrova il suo gestore, se ne aveva uno */
+    sigaction(SIGCHLD, &old, NULL);
+    job_sigfd = -1;
+
+    /* 
+     * Dopo un errore di poll() restano comandi in esecuzione: chiuse 
+     * le pipe non si bloccano scrivendo, e si attendono.
+     */
+    for (i = 0; i < max; i++)
+	if ((j = run[i]) != NULL) {
+	    for (k = 1; k <= 2; k++)
+		if (j->fd[k] != -1)
+		    close(j->fd[k]);
+	    if (j->pid)
+		waitpid(j->pid, NULL, 0);
+	    job_free(j);
+	}
+
+    /* Con `ordered', i conclusi in attesa di quelli prima */
+    for (next = 0; next < ncmd; next++) {
+	if (ordered && cmd[next] && done[next])
+	    job_free(done[next]);
+	free(cmd[next]);
+    }
+
+    close(sp[0]);
+    close(sp[1]);
+    free(line);
+    free(cmd);
+    free(done);
+    free(run);
+    free(pfd);
+
+    return error ? 1 : failed ? 123 : 0;
+}
+
 int
-main(void)
+main(int argc, char **argv)
 {
     pid_t pid;		/* PID del processo figlio */
     pid_t wpid;		/* PID per wait() */
     int status;		/* Stato ritornato da wait() */
 
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	return spawn_bench(argc > 2 ? atoi(argv[2]) : 1000, 
+			   argc > 3 ? atol(argv[3]) : 1024);
+
+    if (argc > 1 && strcmp(argv[1], "run") == 0) {
+	int i, max = 4, ordered = 0;
+
+	for (i = 2; i < argc; i++)
+	    if (strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+		max = atoi(argv[++i]);
+	    else if (strcmp(argv[i], "-o") == 0)
+		ordered = 1;
+	if (max < 1) {
+	    fprintf(stderr, "usage: exec run [-P N] [-o] < commands\n");
+	    return 1;
+	}
+
+	return run_jobs(stdin, max, ordered);
+    }
+
     /* Si crea il processo figlio */
     pid = fork();
 
@@ -123,22 +123,625 @@
  * primitivo corrispondente al tipo usato nel formattatore. In questo modo 
  * assicurete una maggiore portabilita' ai vostri programmi rendendoli 
  * insensibili ad eventuali modifiche alla definizione del tipo pid_t.
+ * 
+ * 
+ * Pool di processi pre-creati ("zygote")
+ * ---------------------------------------
+ *
+ * Ogni lancio con fork() + exec() paga la fork(), tanto piu' cara 
+ * quanto piu' grande e' il padre. Un pool la toglie dal percorso 
+ * critico: all'avvio (quando il processo e' ancora piccolo) si crea un 
+ * processo "zygote", copia del padre in quel momento, che genera 
+ * lavoratori gia' pronti. Ogni lavoratore attende su un socket di 
+ * controllo un comando (argv e descrittori per stdin, stdout e 
+ * stderr, passati con SCM_RIGHTS):
+ *
+ * - senza funzione, il lavoratore esegue il comando con execvp() e 
+ *   viene sostituito: lo zygote ne crea un altro in anticipo;
+ *
+ * - con una funzione, il lavoratore la esegue e torna in attesa del 
+ *   comando successivo (viene riciclato); se muore viene sostituito.
+ *
+ * I lavoratori nascono da un processo intermedio che termina subito: 
+ * il padre, dichiarato "subreaper" con prctl(), li adotta e puo' quindi
+ * attenderli con waitpid() come figli propri. Finche' c'e' un pool il 
+ * padre adotta anche ogni altro nipote rimasto orfano (e deve 
+ * raccoglierlo); zpool_free() dell'ultimo pool rimette le cose come 
+ * erano.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>		/* per fork() e sleep() */
 #include <string.h>		/* per strerror() */
 #include <errno.h>		/* per errno */
-
+#include <time.h>		/* per clock_gettime() */
 #include <sys/types.h>		/* per pid_t */
+#include <sys/prctl.h>		/* per prctl() */
+#include <sys/socket.h>		/* per socketpair(), sendmsg() e recvmsg() */
+#include <sys/wait.h>		/* per waitpid() */
+
+/* Dimensione massima di un comando (argv impacchettato) */
+#define ZPOOL_MSG      (32 * 1024)
+#define ZPOOL_ARGS     256
+
+/* Funzione eseguita dai lavoratori riciclati; ritorna lo stato di uscita */
+typedef int (*zpool_fn)(int argc, char **argv);
+
+/* Stato di un posto del pool */
+#define ZW_EMPTY       0	/* in attesa di un lavoratore dallo zygote */
+#define ZW_IDLE        1
+#define ZW_BUSY        2
+
+typedef struct _zworker zworker;
+
+struct _zworker {
+    pid_t pid;
+    int fd;			/* socket di controllo */
+    int state;
+};
+
+typedef struct _zpool zpool;
+
+struct _zpool {
+    zworker *w;
+    int n;
+    int ctl;			/* socket verso lo zygote */
+    pid_t zygote;
+    int pending;		/* lavoratori chiesti e non ancora arrivati */
+    zpool_fn fn;
+};
+
+/* Intestazione di un comando, seguita dagli argomenti separati da '\0' */
+typedef struct _zjob zjob;
+
+struct _zjob {
+    int argc;
+    int fd[3];			/* 1 se il descrittore e' allegato */
+};
+
+/* Un comando come viaggia sul socket */
+typedef struct _zmsg zmsg;
+
+struct _zmsg {
+    zjob job;
+    char args[ZPOOL_MSG - sizeof(zjob)];
+};
+
+/* Pool esistenti, e se eravamo "subreaper" prima del primo */
+static int zpool_live;
+static int zpool_was_reaper;
+
+/* Ci si dichiara "subreaper" per il primo pool. */
+static int
+zpool_reaper_get(void)
+{
+    int on = 0;
+
+    if (zpool_live == 0) {
+	if (prctl(PR_GET_CHILD_SUBREAPER, &on) == -1
+	    || (!on && prctl(PR_SET_CHILD_SUBREAPER, 1) == -1))
+	    return -1;
+	zpool_was_reaper = on;
+    }
+
+    zpool_live++;
+    return 0;
+}
+
+/* Con l'ultimo pool si torna come prima. */
+static void
+zpool_reaper_put(void)
+{
+    if (--zpool_live == 0 && !zpool_was_reaper)
+	prctl(PR_SET_CHILD_SUBREAPER, 0);
+}
+
+/* Invia `len' byte e (se fd[i] != -1) fino a 3 descrittori. */
+static int
+zpool_send(int sock, const void *buf, size_t len, const int *fd, int nfd)
+{
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { (void *) buf, len };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    int i, k = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    for (i = 0; i < nfd; i++)
+	k += fd[i] != -1;
+
+    if (k > 0) {
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(k * sizeof(int));
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(k * sizeof(int));
+	for (i = 0, k = 0; i < nfd; i++)
+	    if (fd[i] != -1)
+		((int *) CMSG_DATA(c))[k++] = fd[i];
+    }
+
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1)
+	if (errno != EINTR)
+	    return -1;
+
+    return 0;
+}
+
+/* 
+ * Riceve un messaggio e i descrittori allegati (al piu' `maxfd', gli 
+ * altri -1). Ritorna la lunghezza, 0 se l'altro capo e' chiuso, -1.
+ */
+static ssize_t
+zpool_recv(int sock, void *buf, size_t len, int *fd, int maxfd, int flags)
+{
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    ssize_t n;
+    int i, k;
+
+    for (i = 0; i < maxfd; i++)
+	fd[i] = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | flags)) == -1)
+	if (errno != EINTR)
+	    return -1;
+
+    for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+	if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+	    k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	    for (i = 0; i < k; i++)
+		if (i < maxfd)
+		    fd[i] = ((int *) CMSG_DATA(c))[i];
+		else
+		    close(((int *) CMSG_DATA(c))[i]);
+	}
+
+    return n;
+}
+
+/* Il lavoratore: esegue i comandi ricevuti su `sock' */
+static void
+zpool_worker(int sock, zpool_fn fn)
+{
+    static zmsg msg;
+    char *argv[ZPOOL_ARGS + 1], *p, *end;
+    int fd[3], std[3], argc, i, k, status;
+    pid_t pid = getpid();
+    ssize_t n;
+
+    /* Pronto: il padre riceve il PID */
+    if (zpool_send(sock, &pid, sizeof(pid), NULL, 0) == -1)
+	_exit(1);
+
+    for (;;) {
+	if ((n = zpool_recv(sock, &msg, sizeof(msg) - 1, fd, 3, 0)) <= 0)
+	    _exit(0);
+	if ((size_t) n < sizeof(zjob))
+	    _exit(1);
+	end = msg.args + (n - sizeof(zjob));
+	*end = '\0';
+
+	p = msg.args;
+	for (argc = 0; argc < msg.job.argc && argc < ZPOOL_ARGS && p < end; 
+	     argc++, p += strlen(p) + 1)
+	    argv[argc] = p;
+	argv[argc] = NULL;
+
+	/* I descrittori allegati, in ordine, sostituiscono 0, 1 e 2 */
+	for (i = 0, k = 0; i < 3; i++) {
+	    std[i] = -1;
+	    if (msg.job.fd[i]) {
+		if (fn)
+		    std[i] = dup(i);
+		dup2(fd[k], i);
+		close(fd[k++]);
+	    }
+	}
+
+	if (fn == NULL) {
+	    execvp(argv[0], argv);
+	    _exit(127);
+	}
+
+	status = (fn(argc, argv) & 0xff) << 8;	/* come WEXITSTATUS() */
+	fflush(NULL);
+
+	for (i = 0; i < 3; i++)
+	    if (std[i] != -1) {
+		dup2(std[i], i);
+		close(std[i]);
+	    }
+
+	if (zpool_send(sock, &status, sizeof(status), NULL, 0) == -1)
+	    _exit(1);
+    }
+}
+
+/* Lo zygote: crea un lavoratore per ogni byte ricevuto su `ctl' */
+static void
+zpool_zygote(int ctl, zpool_fn fn)
+{
+    int sv[2];
+    pid_t mid;
+    char c;
+
+    while (recv(ctl, &c, 1, 0) == 1) {
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+	    zpool_send(ctl, &c, 1, NULL, 0);
+	    continue;
+	}
+
+	if ((mid = fork()) == 0) {
+	    /* Il processo intermedio termina: il lavoratore e' adottato */
+	    if (fork() == 0) {
+		close(ctl);
+		close(sv[0]);
+		zpool_worker(sv[1], fn);
+	    }
+	    _exit(0);
+	}
+
+	close(sv[1]);
+	if (mid != -1)
+	    waitpid(mid, NULL, 0);
+
+	/* Senza descrittore allegato il padre sa che la fork() e' fallita */
+	zpool_send(ctl, &c, 1, mid != -1 ? &sv[0] : NULL, mid != -1);
+	close(sv[0]);
+    }
+
+    _exit(0);
+}
+
+/* Chiede un lavoratore allo zygote. */
+static void
+zpool_request(zpool *p)
+{
+    char c = 0;
+
+    if (zpool_send(p->ctl, &c, 1, NULL, 0) == 0)
+	p->pending++;
+}
+
+/* 
+ * Riceve i lavoratori in arrivo dallo zygote: almeno uno se `block'.
+ * Ritorna -1 se nessuno e' arrivato.
+ */
+static int
+zpool_fill(zpool *p, int block)
+{
+    int i, fd, got = 0;
+    pid_t pid;
+    char c;
+
+    while (p->pending > 0) {
+	if (zpool_recv(p->ctl, &c, 1, &fd, 1, 
+		       block && !got ? 0 : MSG_DONTWAIT) <= 0)
+	    break;
+	p->pending--;
+	if (fd == -1)
+	    continue;
+
+	if (recv(fd, &pid, sizeof(pid), 0) != sizeof(pid)) {
+	    close(fd);
+	    continue;
+	}
+
+	for (i = 0; i < p->n && p->w[i].state != ZW_EMPTY; i++)
+	    ;
+	if (i == p->n) {
+	    close(fd);
+	    waitpid(pid, NULL, 0);
+	    continue;
+	}
+	p->w[i].pid = pid;
+	p->w[i].fd = fd;
+	p->w[i].state = ZW_IDLE;
+	got++;
+    }
 
+    return got ? 0 : -1;
+}
+
+/* 
+ * Crea un pool di `n' lavoratori. Se `fn' e' NULL i lavoratori 
+ * eseguono i comandi con execvp(), altrimenti chiamano fn(argc, argv). 
+ * Lo zygote e' una copia del processo in questo momento: conviene 
+ * chiamare zpool_new() all'avvio. Fino a zpool_free() il processo e' 
+ * "subreaper" (PR_SET_CHILD_SUBREAPER): adotta anche i nipoti orfani 
+ * che non vengono dal pool. Ritorna NULL in caso di errore.
+ */
+zpool *
+zpool_new(int n, zpool_fn fn)
+{
+    zpool *p;
+    int sv[2], i;
+
+    if ((p = calloc(1, sizeof(zpool))) == NULL)
+	return NULL;
+    if ((p->w = calloc(n, sizeof(zworker))) == NULL) {
+	free(p);
+	return NULL;
+    }
+    p->n = n;
+    p->fn = fn;
+
+    /* I comandi eseguiti dai lavoratori saranno nostri figli */
+    if (zpool_reaper_get() == -1) {
+	free(p->w);
+	free(p);
+	return NULL;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+	zpool_reaper_put();
+	free(p->w);
+	free(p);
+	return NULL;
+    }
+
+    /* Lo zygote non deve ereditare dati non ancora scritti */
+    fflush(NULL);
+    if ((p->zygote = fork()) == 0) {
+	close(sv[0]);
+	zpool_zygote(sv[1], fn);
+    }
+    close(sv[1]);
+    p->ctl = sv[0];
+
+    if (p->zygote == -1) {
+	close(p->ctl);
+	zpool_reaper_put();
+	free(p->w);
+	free(p);
+	return NULL;
+    }
+
+    for (i = 0; i < n; i++)
+	zpool_request(p);
+    while (p->pending > 0 && zpool_fill(p, 1) == 0)
+	;
+
+    return p;
+}
+
+/* 
+ * Esegue `argv' su un lavoratore libero. fd[0..2] (o -1 per ereditare 
+ * quelli del pool) diventano stdin, stdout e stderr del comando. 
+ * Ritorna il PID da passare a zpool_wait(), oppure -1 (con errno): 
+ * EAGAIN se tutti i lavoratori sono occupati, E2BIG se il comando e' 
+ * troppo lungo. Come dopo fork(), se execvp() fallisce il comando 
+ * termina con stato 127.
+ */
+pid_t
+zpool_run(zpool *p, char *const argv[], const int fd[3])
+{
+    static zmsg msg;
+    size_t len = 0, k;
+    int i, none[3] = { -1, -1, -1 };
+    zworker *w = NULL;
+
+    if (fd == NULL)
+	fd = none;
+
+    /* Il lavoratore ha bisogno di un byte per il '\0' finale */
+    for (msg.job.argc = 0; argv[msg.job.argc]; msg.job.argc++) {
+	k = strlen(argv[msg.job.argc]) + 1;
+	if (len + k >= sizeof(msg.args) || msg.job.argc == ZPOOL_ARGS) {
+	    errno = E2BIG;
+	    return -1;
+	}
+	memcpy(msg.args + len, argv[msg.job.argc], k);
+	len += k;
+    }
+    for (i = 0; i < 3; i++)
+	msg.job.fd[i] = fd[i] != -1;
+
+    zpool_fill(p, 0);
+    for (;;) {
+	for (i = 0; i < p->n; i++)
+	    if (p->w[i].state == ZW_IDLE) {
+		w = p->w + i;
+		break;
+	    }
+	if (w || p->pending == 0 || zpool_fill(p, 1) == -1)
+	    break;
+    }
+    if (w == NULL) {
+	errno = EAGAIN;
+	return -1;
+    }
+
+    if (zpool_send(w->fd, &msg, sizeof(zjob) + len, fd, 3) == -1)
+	return -1;
+    w->state = ZW_BUSY;
+
+    if (p->fn)
+	return w->pid;
+
+    /* Il lavoratore diventa il comando: lo zygote ne prepara un altro */
+    close(w->fd);
+    w->state = ZW_EMPTY;
+    zpool_request(p);
+
+    return w->pid;
+}
+
+/* 
+ * Attende il comando `pid' lanciato da zpool_run(); `status' e' come 
+ * quello di waitpid(). Ritorna -1 in caso di errore.
+ */
 int
-main(void)
+zpool_wait(zpool *p, pid_t pid, int *status)
+{
+    zworker *w = NULL;
+    int i, st;
+
+    for (i = 0; i < p->n; i++)
+	if (p->w[i].state == ZW_BUSY && p->w[i].pid == pid)
+	    w = p->w + i;
+
+    if (w == NULL)
+	return waitpid(pid, status, 0) == -1 ? -1 : 0;
+
+    if (recv(w->fd, &st, sizeof(st), 0) == sizeof(st)) {
+	w->state = ZW_IDLE;
+    } else {
+	/* Il lavoratore e' morto durante il comando: lo si sostituisce */
+	waitpid(pid, &st, 0);
+	close(w->fd);
+	w->state = ZW_EMPTY;
+	zpool_request(p);
+    }
+
+    if (status)
+	*status = st;
+    return 0;
+}
+
+/* 
+ * Termina lo zygote e i lavoratori liberi. I comandi ancora in 
+ * esecuzione vanno attesi prima.
+ */
+void
+zpool_free(zpool *p)
+{
+    int i;
+
+    /* I lavoratori in arrivo sono gia' nostri figli */
+    while (p->pending > 0 && zpool_fill(p, 1) == 0)
+	;
+
+    close(p->ctl);
+    waitpid(p->zygote, NULL, 0);
+
+    for (i = 0; i < p->n; i++)
+	if (p->w[i].state != ZW_EMPTY) {
+	    close(p->w[i].fd);
+	    waitpid(p->w[i].pid, NULL, 0);
+	}
+
+    zpool_reaper_put();
+    free(p->w);
+    free(p);
+}
+
+static double
+zpool_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Funzione di esempio per i lavoratori riciclati */
+static int
+zpool_hello(int argc, char **argv)
+{
+    printf("PID %ld: %s, %d args\n", (long) getpid(), argv[0], argc);
+    return argc;
+}
+
+/* 
+ * "fork pool [N [MB]]": N lanci di /bin/true con fork() + execv() e con 
+ * il pool, dopo aver occupato MB megabyte di memoria (per simulare un 
+ * padre grande); si misura il tempo di lancio e quello fino alla 
+ * fine. Poi qualche chiamata ai lavoratori riciclati.
+ */
+static int
+zpool_demo(int n, long mb)
+{
+    static char *argv[] = { "/bin/true", NULL };
+    static char *hello[][6] = {
+	{ "hello", "a", "b", NULL },
+	{ "hello", NULL },
+	{ "hello", "a", "b", "c", "d", NULL },
+    };
+    size_t size = (size_t) mb << 20;
+    double t, launch = 0;
+    char *mem = NULL;
+    pid_t pid;
+    zpool *p;
+    int i, st;
+
+    /* Il pool nasce quando il processo e' ancora piccolo */
+    if ((p = zpool_new(4, NULL)) == NULL) {
+	fprintf(stderr, "%s: zpool_new()\n", strerror(errno));
+	return 1;
+    }
+
+    if (size && (mem = malloc(size)) != NULL)
+	memset(mem, 1, size);
+    printf("%d launches of /bin/true, %ld MB resident\n", n, mem ? mb : 0L);
+
+    t = zpool_now();
+    for (i = 0; i < n; i++) {
+	double t0 = zpool_now();
+
+	if ((pid = fork()) == 0) {
+	    execv(argv[0], argv);
+	    _exit(127);
+	}
+	launch += zpool_now() - t0;
+	waitpid(pid, NULL, 0);
+    }
+    printf("fork+exec: %8.1f us launch, %8.1f us total\n",
+	   launch / n * 1e6, (zpool_now() - t) / n * 1e6);
+
+    launch = 0;
+    t = zpool_now();
+    for (i = 0; i < n; i++) {
+	double t0 = zpool_now();
+
+	if ((pid = zpool_run(p, argv, NULL)) == -1) {
+	    fprintf(stderr, "%s: zpool_run()\n", strerror(errno));
+	    return 1;
+	}
+	launch += zpool_now() - t0;
+	zpool_wait(p, pid, NULL);
+    }
+    printf("pool:      %8.1f us launch, %8.1f us total\n",
+	   launch / n * 1e6, (zpool_now() - t) / n * 1e6);
+    zpool_free(p);
+    free(mem);
+
+    if ((p = zpool_new(2, zpool_hello)) == NULL)
+	return 1;
+    for (i = 0; i < 3; i++) {
+	pid = zpool_run(p, hello[i], NULL);
+	zpool_wait(p, pid, &st);
+	printf("PID %ld: exit status %d\n", (long) pid, WEXITSTATUS(st));
+    }
+    zpool_free(p);
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
 {
     pid_t pid;		/* PID del processo figlio */
     int sts;		/* Stato ritornato al sistema operativo */
 
+    if (argc > 1 && strcmp(argv[1], "pool") == 0)
+	return zpool_demo(argc > 2 ? atoi(argv[2]) : 1000, 
+			  argc > 3 ? atol(argv[3]) : 1024);
+
     pid = fork();		/* Crea un nuovo processo figlio */
 
     if (pid == -1) {
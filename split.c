@@ -21,13 +21,180 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+
+/*
+ * Fields are returned as (pointer, length) views into the input, 
+ * which need not be NUL terminated.
+ */
+typedef struct _strview strview;
+
+struct _strview {
+    const char *ptr;
+    size_t len;
+};
+
+/* 
+ * Field callback: `field' (not NUL terminated) is the `index'-th field. 
+ * A non zero return stops the split.
+ */
+typedef int (*split_fn)(const char *field, size_t len, int index, void *arg);
+
+/*
+ * Separator scanning. The input is compared with the separator 64 
+ * bytes at a time (4 SSE2, 2 AVX2 or 1 AVX-512BW compare); the 
+ * matches make a 64 bit mask whose set bits, taken out with ctz, are 
+ * the separator offsets. The widest variant the CPU supports is 
+ * picked at startup.
+ */
+#define SPLIT_BLOCK    64
+
+typedef uint64_t (*split_mask_fn)(const char *p, char sep);
+
+static uint64_t
+split_mask_scalar(const char *p, char sep)
+{
+    uint64_t m = 0;
+    int i;
+
+    for (i = 0; i < SPLIT_BLOCK; i++)
+	m |= (uint64_t) (p[i] == sep) << i;
+
+    return m;
+}
+
+#if defined(__x86_64__)
+static __attribute__((target("sse2"))) uint64_t
+split_mask_sse2(const char *p, char sep)
+{
+    __m128i s = _mm_set1_epi8(sep);
+    uint64_t m0, m1, m2, m3;
+
+    m0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(
+	_mm_loadu_si128((const __m128i *) p), s));
+    m1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(
+	_mm_loadu_si128((const __m128i *) (p + 16)), s));
+    m2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(
+	_mm_loadu_si128((const __m128i *) (p + 32)), s));
+    m3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(
+	_mm_loadu_si128((const __m128i *) (p + 48)), s));
+
+    return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+}
+
+static __attribute__((target("avx2"))) uint64_t
+split_mask_avx2(const char *p, char sep)
+{
+    __m256i s = _mm256_set1_epi8(sep);
+    uint64_t lo, hi;
+
+    lo = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+	_mm256_loadu_si256((const __m256i *) p), s));
+    hi = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+	_mm256_loadu_si256((const __m256i *) (p + 32)), s));
+
+    return lo | hi << 32;
+}
+
+static __attribute__((target("avx512f,avx512bw"))) uint64_t
+split_mask_avx512(const char *p, char sep)
+{
+    return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p), _mm512_set1_epi8(sep));
+}
+#endif /* __x86_64__ */
+
+static split_mask_fn split_mask = split_mask_scalar;
+
+static void __attribute__((constructor))
+split_init(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512bw"))
+	split_mask = split_mask_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+	split_mask = split_mask_avx2;
+    else
+	split_mask = split_mask_sse2;
+#endif
+}
+
+/* 
+ * Call `fn' on every field of `string[0..len-1]'. Returns the number 
+ * of fields passed to `fn'.
+ */
+static int
+split_scan(const char *string, size_t len, char sep, split_fn fn, void *arg)
+{
+    size_t i, pos, start = 0;
+    uint64_t m;
+    int c = 0;
+
+    for (i = 0; i + SPLIT_BLOCK <= len; i += SPLIT_BLOCK)
+	for (m = split_mask(string + i, sep); m; m &= m - 1) {
+	    pos = i + __builtin_ctzll(m);
+	    if (fn(string + start, pos - start, c++, arg))
+		return c;
+	    start = pos + 1;
+	}
+
+    /* Last partial block. */
+    for (; i < len; i++)
+	if (string[i] == sep) {
+	    if (fn(string + start, i - start, c++, arg))
+		return c;
+	    start = i + 1;
+	}
+
+    fn(string + start, len - start, c++, arg);
+    return c;
+}
+
+/* Number of fields of `string[0..len-1]': one more than separators. */
+size_t
+split_count(const char *string, size_t len, char sep)
+{
+    size_t i, c = 1;
+
+    for (i = 0; i + SPLIT_BLOCK <= len; i += SPLIT_BLOCK)
+	c += __builtin_popcountll(split_mask(string + i, sep));
+
+    for (; i < len; i++)
+	c += string[i] == sep;
+
+    return c;
+}
+
+/* split_scan() callback of split(): copy the field. */
+static int
+split_dup(const char *field, size_t len, int index, void *arg)
+{
+    char **argv = arg;
+
+    if ((argv[index] = malloc(len + 1)) != NULL) {
+	memcpy(argv[index], field, len);
+	argv[index][len] = 0;
+    }
+
+    return 0;
+}
 
 char **
 split(const char *string, char sep, int *argc)
 {
     char **argv = NULL;
-    char *buf, *p, *q; 
-    int c = 1, i = 0;
+    size_t len;
+    int c;
 
     if (string == NULL) 
 	return NULL;
@@ -35,53 +202,809 @@ split(const char *string, char sep, int *argc)
     if (argc == NULL)
 	return NULL; 
 
-    buf = p = q = strdup(string);
+    len = strlen(string);
+    c = split_count(string, len, sep);
 
-    while ((p = strchr(buf, sep)) != NULL) {
-	c++;
-	buf = ++p;
-    }
-    
-    buf = q;
-    argv = malloc(c * sizeof(char *));
+    if ((argv = malloc(c * sizeof(char *))) == NULL)
+	return NULL;
 	
-    while ((p = strchr(buf, sep)) != NULL) {
-	*p++ = 0;
-	argv[i++] = strdup(buf);
-	buf = p;
-    }
-
-    /* Store last item. */
-    argv[i] = strdup(buf);
+    split_scan(string, len, sep, split_dup, argv);
 
-    /* Cleanup. */
-    free(q);
-    
     /* Return values. */
     *argc = c;
     return argv;
 }
 
+/*
+ * Zero-copy variants: no field is copied and nothing is allocated.
+ */
+
+/* 
+ * Call `fn' on every field of `string[0..len-1]'. Returns the number 
+ * of fields passed to `fn'.
+ */
 int
-main(void)
+split_each(const char *string, size_t len, char sep, split_fn fn, void *arg)
 {
-    int argc, i;
-    char **argv, input[50], *p;
-    
-    (void) fgets(input, 50, stdin);
-    
-    p = strchr(input,'\n');
+    return split_scan(string, len, sep, fn, arg);
+}
+
+/* Output of split_views(). */
+typedef struct _split_out split_out;
+
+struct _split_out {
+    strview *fields;
+    int max;
+};
+
+static int
+split_store(const char *field, size_t len, int index, void *arg)
+{
+    split_out *out = arg;
 
-    if (p) {
-	*p = 0;
+    if (index < out->max) {
+	out->fields[index].ptr = field;
+	out->fields[index].len = len;
     }
-	
-    argv = split(input, ' ', &argc);
-    
-    for (i = 0; i < argc; i++) {
-	printf("argv[%d] = '%s'\n", i, argv[i]);
+
+    return 0;
+}
+
+/* 
+ * Store up to `max' fields of `string[0..len-1]' into `fields'. Returns 
+ * the number of fields of the input: if more than `max', only the 
+ * first `max' were stored.
+ */
+int
+split_views(const char *string, size_t len, char sep, strview *fields, int max)
+{
+    split_out out = { fields, max };
+
+    return split_scan(string, len, sep, split_store, &out);
+}
+
+/* Bytes of arena split_arena() needs for `string'. */
+size_t
+split_arena_size(const char *string, char sep)
+{
+    size_t len = strlen(string);
+
+    return (split_count(string, len, sep) + 1) * sizeof(char *) + len + 1;
+}
+
+/* Layout of split_arena(): argv, then the copy of the string. */
+typedef struct _split_layout split_layout;
+
+struct _split_layout {
+    const char *string;
+    char **argv;
+    char *buf;
+};
+
+static int
+split_place(const char *field, size_t len, int index, void *arg)
+{
+    split_layout *l = arg;
+
+    l->argv[index] = l->buf + (field - l->string);
+    l->argv[index][len] = 0;
+    return 0;
+}
+
+/* 
+ * Same result as split(), but laid out in the caller's `arena' (of 
+ * `size' bytes, aligned as malloc() would): a NULL terminated pointer 
+ * array followed by a copy of `string' with the separators replaced 
+ * by NUL. Nothing is allocated and nothing needs to be freed besides 
+ * the arena itself. Returns NULL if the arena is too small (see 
+ * split_arena_size()).
+ */
+char **
+split_arena(const char *string, char sep, void *arena, size_t size, int *argc)
+{
+    split_layout l;
+    size_t len;
+    int c;
+
+    if (string == NULL || argc == NULL)
+	return NULL;
+
+    len = strlen(string);
+    c = split_count(string, len, sep);
+
+    if ((c + 1) * sizeof(char *) + len + 1 > size)
+	return NULL;
+
+    l.string = string;
+    l.argv = arena;
+    l.buf = (char *) (l.argv + c + 1);
+    memcpy(l.buf, string, len + 1);
+
+    split_scan(string, len, sep, split_place, &l);
+    l.argv[c] = NULL;
+
+    *argc = c;
+    return l.argv;
+}
+
+/*
+ * Delimited records (CSV, TSV, ...): any byte of a set of delimiters 
+ * ends a field, with optional RFC 4180 quoting and optional collapsing 
+ * of repeated delimiters. Records without a quote character take the 
+ * same allocation free scan as split_each() (the SIMD one if there is 
+ * a single delimiter).
+ */
+#define SPLIT_QUOTED   1	/* "a ""quoted"", field" */
+#define SPLIT_COLLAPSE 2	/* no empty fields: runs of delimiters are one */
+
+typedef struct _split_set split_set;
+
+struct _split_set {
+    uint64_t map[4];		/* 256 bit table of the delimiters */
+    char first;			/* the delimiter, if there is only one */
+    int ndelims;
+    char quote;
+    int flags;
+};
+
+#define SPLIT_ISDELIM(set, c) \
+    ((set)->map[(unsigned char) (c) >> 6] >> ((unsigned char) (c) & 63) & 1)
+
+/* 
+ * Delimiters are the bytes of `delims'; `quote' is only used with 
+ * SPLIT_QUOTED. 
+ */
+void
+split_set_init(split_set *set, const char *delims, char quote, int flags)
+{
+    memset(set, 0, sizeof(split_set));
+
+    for (; *delims; delims++) {
+	if (!SPLIT_ISDELIM(set, *delims))
+	    set->ndelims++;
+	set->map[(unsigned char) *delims >> 6] |= 1ULL << ((unsigned char) *delims & 63);
+	set->first = *delims;
     }
-    
+
+    set->quote = quote;
+    set->flags = flags;
+}
+
+/* Callback wrapper dropping empty fields (SPLIT_COLLAPSE). */
+typedef struct _split_filter split_filter;
+
+struct _split_filter {
+    split_fn fn;
+    void *arg;
+    int c;			/* fields passed on */
+    int stop;
+};
+
+static int
+split_nonempty(const char *field, size_t len, int index, void *arg)
+{
+    split_filter *f = arg;
+
+    (void) index;
+    if (len == 0)
+	return 0;
+
+    return f->stop = f->fn(field, len, f->c++, f->arg);
+}
+
+/* Unquoted record, several delimiters: table lookup per byte. */
+static int
+split_set_scan(const char *string, size_t len, const split_set *set, 
+	       split_fn fn, void *arg)
+{
+    size_t i, start = 0;
+    int c = 0;
+
+    for (i = 0; i < len; i++)
+	if (SPLIT_ISDELIM(set, string[i])) {
+	    if (fn(string + start, i - start, c++, arg))
+		return c;
+	    start = i + 1;
+	}
+
+    fn(string + start, len - start, c++, arg);
+    return c;
+}
+
+/* 
+ * Call `fn' on every field of the record `string[0..len-1]'. Returns 
+ * the number of fields passed to `fn'.
+ *
+ * With SPLIT_QUOTED a field starting with the quote character runs to 
+ * the matching closing quote (delimiters and newlines included) and is 
+ * passed without its quotes; text between the closing quote and the 
+ * next delimiter is ignored. A doubled quote inside stands for one 
+ * quote: the field is then unescaped into `scratch' (at least `len' 
+ * bytes, only valid during the call of `fn'), or passed as is if 
+ * `scratch' is NULL. With SPLIT_COLLAPSE empty unquoted fields are 
+ * not reported.
+ */
+int
+split_fields(const char *string, size_t len, const split_set *set, 
+	     char *scratch, split_fn fn, void *arg)
+{
+    split_filter f = { fn, arg, 0, 0 };
+    const char *p = string, *end = string + len, *q, *r, *field;
+    size_t n;
+    int escaped;
+
+    if (!(set->flags & SPLIT_QUOTED) || memchr(string, set->quote, len) == NULL) {
+	if (set->flags & SPLIT_COLLAPSE) {
+	    fn = split_nonempty;
+	    arg = &f;
+	}
+	if (set->ndelims == 1)
+	    n = split_scan(string, len, set->first, fn, arg);
+	else
+	    n = split_set_scan(string, len, set, fn, arg);
+	return set->flags & SPLIT_COLLAPSE ? f.c : (int) n;
+    }
+
+    for (;;) {
+	if (p < end && *p == set->quote) {
+	    /* Quoted field: find the closing quote, skipping "". */
+	    escaped = 0;
+	    for (q = p + 1; (q = memchr(q, set->quote, end - q)) != NULL 
+		     && q + 1 < end && q[1] == set->quote; q += 2)
+		escaped = 1;
+	    if (q == NULL)
+		q = end;	/* unterminated: up to the end */
+
+	    field = p + 1;
+	    n = q - field;
+	    if (escaped && scratch) {
+		for (r = field, n = 0; r < q; r++) {
+		    scratch[n++] = *r;
+		    if (*r == set->quote)
+			r++;
+		}
+		field = scratch;
+	    }
+
+	    if (fn(field, n, f.c++, arg))
+		return f.c;
+
+	    for (p = q < end ? q + 1 : end; p < end && !SPLIT_ISDELIM(set, *p); p++)
+		;
+	} else {
+	    for (q = p; q < end && !SPLIT_ISDELIM(set, *q); q++)
+		;
+
+	    if ((q > p || !(set->flags & SPLIT_COLLAPSE)) 
+		&& fn(p, q - p, f.c++, arg))
+		return f.c;
+	    p = q;
+	}
+
+	if (p == end)
+	    return f.c;
+	p++;			/* the delimiter */
+    }
+}
+
+/*
+ * Whole files. The input is either mapped (regular files) or read in 
+ * large chunks (pipes and the like), and every block is scanned once 
+ * for both newlines and separators with the SIMD masks above. Each 
+ * record (line, without its newline) is passed to a callback as an 
+ * array of field views, only valid during the call. A record that 
+ * straddles two chunks is kept and completed by the next read, the 
+ * scan resuming where it stopped (a long record is scanned once).
+ */
+#ifndef SPLIT_CHUNK
+# define SPLIT_CHUNK   (1 << 20)
+#endif
+
+/* 
+ * Record callback: `fields[0..nfields-1]' are the fields of the 
+ * `record'-th line. A non zero return stops the split.
+ */
+typedef int (*split_record_fn)(const strview *fields, int nfields, 
+			       long record, void *arg);
+
+typedef struct _split_reader split_reader;
+
+struct _split_reader {
+    char sep;
+    split_record_fn fn;
+    void *arg;
+    strview *fields;		/* grown as needed */
+    int max;
+    long records;
+    int stop;
+    int failed;			/* out of memory (stop is also set) */
+    /* Incomplete record, as offsets into the buffer: */
+    size_t scan;		/* first byte not scanned yet */
+    size_t start;		/* of the current field */
+    size_t rec;			/* of the record */
+    int n;			/* fields found so far */
+};
+
+static void
+split_reader_init(split_reader *r, char sep, split_record_fn fn, void *arg)
+{
+    memset(r, 0, sizeof(split_reader));
+    r->sep = sep;
+    r->fn = fn;
+    r->arg = arg;
+}
+
+/* Append a field; -1 on allocation failure. */
+static int
+split_add_field(split_reader *r, int n, const char *field, size_t len)
+{
+    strview *p;
+
+    if (n == r->max) {
+	p = realloc(r->fields, (r->max ? r->max * 2 : 16) * sizeof(strview));
+	if (p == NULL)
+	    return -1;
+	r->fields = p;
+	r->max = r->max ? r->max * 2 : 16;
+    }
+
+    r->fields[n].ptr = field;
+    r->fields[n].len = len;
+    return 0;
+}
+
+/* 
+ * Split the complete records of `buf[0..len-1]', and with `final' the 
+ * last one even if it has no newline. The scan resumes from the 
+ * incomplete record left by the previous call on the same buffer (see 
+ * split_rebase()). Returns the bytes consumed, i.e. the start of the 
+ * incomplete last record; r->stop is set when the callback stopped 
+ * the split, and r->failed too on allocation failure.
+ */
+static size_t
+split_records(split_reader *r, const char *buf, size_t len, int final)
+{
+    size_t i = r->scan, pos, start = r->start, rec = r->rec;
+    uint64_t m, nl;
+    int n = r->n;
+
+#define SPLIT_BOUNDARY(pos, newline)					\
+    do {								\
+	if (split_add_field(r, n++, buf + start, (pos) - start) < 0) {	\
+	    r->stop = r->failed = 1;					\
+	    return rec;							\
+	}								\
+	start = (pos) + 1;						\
+	if (newline) {							\
+	    if (r->fn(r->fields, n, r->records++, r->arg)) {		\
+		r->stop = 1;						\
+		return start;						\
+	    }								\
+	    n = 0;							\
+	    rec = start;						\
+	}								\
+    } while (0)
+
+    for (; i + SPLIT_BLOCK <= len; i += SPLIT_BLOCK) {
+	nl = split_mask(buf + i, '\n');
+	for (m = nl | split_mask(buf + i, r->sep); m; m &= m - 1) {
+	    pos = i + __builtin_ctzll(m);
+	    SPLIT_BOUNDARY(pos, nl >> (pos - i) & 1);
+	}
+    }
+
+    for (; i < len; i++)
+	if (buf[i] == '\n' || buf[i] == r->sep)
+	    SPLIT_BOUNDARY(i, buf[i] == '\n');
+
+#undef SPLIT_BOUNDARY
+
+    /* Last record, without newline. */
+    if (final && rec < len) {
+	if (split_add_field(r, n++, buf + start, len - start) < 0)
+	    r->stop = r->failed = 1;
+	else if (r->fn(r->fields, n, r->records++, r->arg))
+	    r->stop = 1;
+	return len;
+    }
+
+    r->scan = len;
+    r->start = start;
+    r->rec = rec;
+    r->n = n;
+    return rec;
+}
+
+/* 
+ * The incomplete record moved from `from' to `to' and `done' bytes 
+ * before it were dropped from the buffer: follow it.
+ */
+static void
+split_rebase(split_reader *r, const char *from, const char *to, size_t done)
+{
+    int i;
+
+    for (i = 0; i < r->n; i++)
+	r->fields[i].ptr = to + (r->fields[i].ptr - from);
+
+    r->scan -= done;
+    r->start -= done;
+    r->rec -= done;
+}
+
+/* 
+ * Split every line of `fd' on `sep', calling `fn' for each. Returns 
+ * the number of records passed to `fn', -1 with errno set on error.
+ */
+long
+split_file(int fd, char sep, split_record_fn fn, void *arg)
+{
+    split_reader r;
+    struct stat st;
+    char *buf, *p;
+    size_t size = SPLIT_CHUNK, used = 0, done;
+    ssize_t n;
+    int err = 0;
+
+    split_reader_init(&r, sep, fn, arg);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf != MAP_FAILED) {
+	    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+	    split_records(&r, buf, st.st_size, 1);
+	    munmap(buf, st.st_size);
+	    free(r.fields);
+	    if (r.failed) {
+		errno = ENOMEM;
+		return -1;
+	    }
+	    return r.records;
+	}
+    }
+
+    /* Not mappable: page aligned chunks, the partial record moved first. */
+    if ((buf = aligned_alloc(4096, size)) == NULL)
+	return -1;
+
+    while (!r.stop) {
+	if (used == size) {
+	    /* A record longer than the buffer (realloc() would not keep 
+	     * the alignment). */
+	    if ((p = aligned_alloc(4096, size * 2)) == NULL) {
+		err = ENOMEM;
+		break;
+	    }
+	    memcpy(p, buf, used);
+	    split_rebase(&r, buf, p, 0);
+	    free(buf);
+	    buf = p;
+	    size *= 2;
+	}
+
+	if ((n = read(fd, buf + used, size - used)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    err = errno;
+	    break;
+	}
+
+	used += n;
+	done = split_records(&r, buf, used, n == 0);
+	if (r.failed) {
+	    err = ENOMEM;
+	    break;
+	}
+	memmove(buf, buf + done, used - done);
+	split_rebase(&r, buf + done, buf, done);
+	used -= done;
+
+	if (n == 0)
+	    break;
+    }
+
+    free(buf);
+    free(r.fields);
+    if (err) {
+	errno = err;
+	return -1;
+    }
+    return r.records;
+}
+
+/*
+ * Parallel splitting of a large buffer. The buffer is cut into one 
+ * range per thread, each cut moved forward to just after a newline so 
+ * that ranges hold whole records. Every worker tokenises its range 
+ * into its own arena (field views plus the end of each record), and 
+ * the records are then passed to the callback in input order, worker 
+ * after worker, as each one is joined.
+ */
+typedef struct _split_worker split_worker;
+
+struct _split_worker {
+    pthread_t tid;
+    const char *buf;		/* whole records */
+    size_t len;
+    char sep;
+    strview *fields;		/* of all the records */
+    size_t nfields;
+    size_t maxfields;
+    size_t *ends;		/* one past the last field of each record */
+    size_t nrecords;
+    size_t maxrecords;
+    int failed;
+};
+
+/* split_records() callback of the workers: append to the arena. */
+static int
+split_collect(const strview *fields, int nfields, long record, void *arg)
+{
+    split_worker *w = arg;
+    void *p;
+    size_t max;
+
+    (void) record;
+
+    if (w->nfields + nfields > w->maxfields) {
+	for (max = w->maxfields ? w->maxfields : 1024; 
+	     max < w->nfields + nfields; max *= 2)
+	    ;
+	if ((p = realloc(w->fields, max * sizeof(strview))) == NULL)
+	    return w->failed = 1;
+	w->fields = p;
+	w->maxfields = max;
+    }
+
+    if (w->nrecords == w->maxrecords) {
+	max = w->maxrecords ? w->maxrecords * 2 : 256;
+	if ((p = realloc(w->ends, max * sizeof(size_t))) == NULL)
+	    return w->failed = 1;
+	w->ends = p;
+	w->maxrecords = max;
+    }
+
+    memcpy(w->fields + w->nfields, fields, nfields * sizeof(strview));
+    w->nfields += nfields;
+    w->ends[w->nrecords++] = w->nfields;
+    return 0;
+}
+
+static void *
+split_worker_main(void *arg)
+{
+    split_worker *w = arg;
+    split_reader r;
+
+    split_reader_init(&r, w->sep, split_collect, w);
+    split_records(&r, w->buf, w->len, 1);
+    if (r.failed)
+	w->failed = 1;
+    free(r.fields);
+    return NULL;
+}
+
+/* 
+ * Split the lines of `buf[0..len-1]' on `sep' with `nthreads' threads, 
+ * calling `fn' for each record in order (from the calling thread). 
+ * Returns the number of records passed to `fn', -1 on failure.
+ */
+long
+split_parallel(const char *buf, size_t len, char sep, int nthreads, 
+	       split_record_fn fn, void *arg)
+{
+    split_reader r;
+    split_worker *w;
+    const char *p;
+    size_t cut, prev = 0, i, first;
+    long records = 0;
+    int t, started, stop = 0, failed = 0;
+
+    if (nthreads <= 1) {
+	split_reader_init(&r, sep, fn, arg);
+	split_records(&r, buf, len, 1);
+	free(r.fields);
+	if (r.failed) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	return r.records;
+    }
+
+    if ((w = calloc(nthreads, sizeof(split_worker))) == NULL)
+	return -1;
+
+    for (t = 0; t < nthreads; t++) {
+	if (t == nthreads - 1) {
+	    cut = len;
+	} else {
+	    cut = len / nthreads * (t + 1);
+	    if (cut < prev)
+		cut = prev;
+	    p = memchr(buf + cut, '\n', len - cut);
+	    cut = p ? (size_t) (p - buf) + 1 : len;
+	}
+	w[t].buf = buf + prev;
+	w[t].len = cut - prev;
+	w[t].sep = sep;
+	prev = cut;
+    }
+
+    for (started = 0; started < nthreads; started++)
+	if (pthread_create(&w[started].tid, NULL, split_worker_main, 
+			   w + started) != 0)
+	    break;
+
+    /* Whatever could not be started is done here. */
+    for (t = started; t < nthreads; t++)
+	split_worker_main(w + t);
+
+    for (t = 0; t < nthreads; t++) {
+	if (t < started)
+	    pthread_join(w[t].tid, NULL);
+	failed |= w[t].failed;
+
+	for (i = 0, first = 0; !stop && !failed && i < w[t].nrecords; i++) {
+	    stop = fn(w[t].fields + first, w[t].ends[i] - first, records++, arg);
+	    first = w[t].ends[i];
+	}
+
+	free(w[t].fields);
+	free(w[t].ends);
+    }
+
+    free(w);
+    if (failed) {
+	/* Workers only fail to grow their arrays. */
+	errno = ENOMEM;
+	return -1;
+    }
+    return records;
+}
+
+/* 
+ * split_file() with `nthreads' threads on regular files (mapped and 
+ * passed to split_parallel()); other inputs are read by split_file().
+ */
+long
+split_file_parallel(int fd, char sep, int nthreads, split_record_fn fn, 
+		    void *arg)
+{
+    struct stat st;
+    char *buf;
+    long n;
+
+    if (nthreads <= 1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) 
+	|| st.st_size == 0)
+	return split_file(fd, sep, fn, arg);
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED)
+	return split_file(fd, sep, fn, arg);
+
+    n = split_parallel(buf, st.st_size, sep, nthreads, fn, arg);
+    munmap(buf, st.st_size);
+    return n;
+}
+
+/* split_each() / split_fields() callback of the checks: "f1|f2|...". */
+static int
+join_field(const char *field, size_t len, int index, void *arg)
+{
+    char *out = arg;
+
+    if (index > 0)
+	strcat(out, "|");
+    strncat(out, field, len);
     return 0;
 }
 
+/* 
+ * Checks of the string variants; returns 0, or -1 after printing the 
+ * failed one.
+ */
+static int
+split_check(void)
+{
+    const char *line = "a bb  ccc d";
+    char **argv, out[128], scratch[64];
+    char *arena[32];		/* pointers first: aligned for them */
+    strview views[8];
+    split_set set;
+    int argc, n, i;
+
+    argv = split(line, ' ', &argc);
+    if (argv == NULL || argc != 5 || strcmp(argv[0], "a") != 0 
+	|| strcmp(argv[2], "") != 0 || strcmp(argv[4], "d") != 0) {
+	printf("test failed (split).\n");
+	return -1;
+    }
+    for (i = 0; i < argc; i++)
+	free(argv[i]);
+    free(argv);
+
+    out[0] = '\0';
+    n = split_each(line, strlen(line), ' ', join_field, out);
+    if (n != 5 || strcmp(out, "a|bb||ccc|d") != 0) {
+	printf("test failed (split_each).\n");
+	return -1;
+    }
+
+    n = split_views(line, strlen(line), ' ', views, 3);
+    if (n != 5 || views[1].len != 2 || views[1].ptr != line + 2 
+	|| views[2].len != 0) {
+	printf("test failed (split_views).\n");
+	return -1;
+    }
+
+    argv = split_arena(line, ' ', arena, sizeof(arena), &argc);
+    if (split_arena_size(line, ' ') > sizeof(arena) || argv == NULL 
+	|| argc != 5 || strcmp(argv[3], "ccc") != 0 || argv[5] != NULL
+	|| split_arena(line, ' ', arena, 8, &argc) != NULL) {
+	printf("test failed (split_arena).\n");
+	return -1;
+    }
+
+    split_set_init(&set, ",;", '"', SPLIT_QUOTED);
+    out[0] = '\0';
+    n = split_fields("x,\"a, \"\"b\"\"\";,z", 15, &set, scratch, 
+		     join_field, out);
+    if (n != 4 || strcmp(out, "x|a, \"b\"||z") != 0) {
+	printf("test failed (split_fields, SPLIT_QUOTED).\n");
+	return -1;
+    }
+
+    split_set_init(&set, " \t", 0, SPLIT_COLLAPSE);
+    out[0] = '\0';
+    n = split_fields(" a \t b  ", 8, &set, NULL, join_field, out);
+    if (n != 2 || strcmp(out, "a|b") != 0) {
+	printf("test failed (split_fields, SPLIT_COLLAPSE).\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+/* split_file() callback of the demo. */
+static int
+print_record(const strview *fields, int nfields, long record, void *arg)
+{
+    int i;
+
+    (void) arg;
+    printf("record %ld:\n", record);
+    for (i = 0; i < nfields; i++)
+	printf("argv[%d] = '%.*s'\n", i, (int) fields[i].len, fields[i].ptr);
+
+    return 0;
+}
+
+/* 
+ * Check the string variants, then split the lines of the given file, 
+ * or of the standard input; with -j N files are split by N threads.
+ */
+int
+main(int argc, char **argv)
+{
+    int fd = 0, nthreads = 1;
+
+    if (split_check() < 0)
+	return 1;
+
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+	nthreads = atoi(argv[2]);
+	argc -= 2;
+	argv += 2;
+    }
+
+    if (argc > 1 && (fd = open(argv[1], O_RDONLY)) == -1) {
+	fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+	return 1;
+    }
+
+    if (split_file_parallel(fd, ' ', nthreads, print_record, NULL) < 0) {
+	fprintf(stderr, "%s\n", strerror(errno));
+	return 1;
+    }
+    
+    return 0;
+}
@@ -20,7 +20,10 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
+#include <stdint.h>
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
 
 /* Strip mode. */
 #define STRIP_TRAILING 0
@@ -31,41 +34,264 @@
 #define strip(s) strip2((s), STRIP_BOTH)
 #define chug(s) strip2((s), STRIP_TRAILING)
 #define chomp(s) strip2((s), STRIP_LEADING)
+#define strip_all(f, n) strip_views((f), (n), STRIP_BOTH)
+#define chug_all(f, n) strip_views((f), (n), STRIP_TRAILING)
+#define chomp_all(f, n) strip_views((f), (n), STRIP_LEADING)
 
+/*
+ * A (pointer, length) view into a string, which need not be NUL 
+ * terminated.
+ */
+typedef struct _strview strview;
+
+struct _strview {
+    const char *ptr;
+    size_t len;
+};
+
+/*
+ * Whitespace is the ASCII set of isspace() in the C locale: ' ' and 
+ * '\t' to '\r'. Runs of it are skipped 32 bytes at a time (2 SSE2 or 
+ * 1 AVX2 compare): the mask has a bit set for each whitespace byte. 
+ * The widest variant the CPU supports is picked at startup.
+ */
+#define STRIP_BLOCK    32
+
+#define STRIP_ISSPACE(c) ((c) == ' ' || (unsigned char) ((c) - '\t') < 5)
+
+typedef uint32_t (*strip_mask_fn)(const char *p);
+
+static uint32_t
+strip_mask_scalar(const char *p)
+{
+    uint32_t m = 0;
+    int i;
+
+    for (i = 0; i < STRIP_BLOCK; i++)
+	m |= (uint32_t) STRIP_ISSPACE(p[i]) << i;
+
+    return m;
+}
+
+#if defined(__x86_64__)
+static __attribute__((target("sse2"))) uint32_t
+strip_mask_sse2(const char *p)
+{
+    __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+    __m128i four = _mm_set1_epi8(4), x, d;
+    uint32_t lo, hi;
+
+    /* c == ' ' or (unsigned) (c - '\t') <= 4 */
+    x = _mm_loadu_si128((const __m128i *) p);
+    d = _mm_sub_epi8(x, tab);
+    lo = (uint16_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, sp),
+	_mm_cmpeq_epi8(_mm_min_epu8(d, four), d)));
+
+    x = _mm_loadu_si128((const __m128i *) (p + 16));
+    d = _mm_sub_epi8(x, tab);
+    hi = (uint16_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, sp),
+	_mm_cmpeq_epi8(_mm_min_epu8(d, four), d)));
+
+    return lo | hi << 16;
+}
+
+static __attribute__((target("avx2"))) uint32_t
+strip_mask_avx2(const char *p)
+{
+    __m256i x = _mm256_loadu_si256((const __m256i *) p);
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+
+    return _mm256_movemask_epi8(_mm256_or_si256(
+	_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+	_mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(4)), d)));
+}
+#endif /* __x86_64__ */
+
+static strip_mask_fn strip_mask = strip_mask_scalar;
+
+static void __attribute__((constructor))
+strip_init(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+	strip_mask = strip_mask_avx2;
+    else
+	strip_mask = strip_mask_sse2;
+#endif
+}
+
+/* Length of the leading whitespace of `s[0..len-1]'. */
+static size_t
+strip_lead(const char *s, size_t len)
+{
+    size_t i = 0;
+    uint32_t m;
+
+    for (; i + STRIP_BLOCK <= len; i += STRIP_BLOCK) {
+	/* Most fields have little or no padding. */
+	if (!STRIP_ISSPACE(s[i]))
+	    return i;
+	if ((m = ~strip_mask(s + i)) != 0)
+	    return i + __builtin_ctz(m);
+    }
+
+    while (i < len && STRIP_ISSPACE(s[i]))
+	i++;
+
+    return i;
+}
+
+/* Length of `s[0..len-1]' without its trailing whitespace. */
+static size_t
+strip_trail(const char *s, size_t len)
+{
+    uint32_t m;
+
+    for (; len >= STRIP_BLOCK; len -= STRIP_BLOCK) {
+	if (!STRIP_ISSPACE(s[len - 1]))
+	    return len;
+	if ((m = ~strip_mask(s + len - STRIP_BLOCK)) != 0)
+	    return len - __builtin_clz(m);
+    }
+
+    while (len > 0 && STRIP_ISSPACE(s[len - 1]))
+	len--;
+
+    return len;
+}
+
+/* 
+ * View of `s[0..len-1]' without its leading and/or trailing 
+ * whitespace, according to `how'. Nothing is copied nor written.
+ */
+strview
+strip_view(const char *s, size_t len, int how)
+{
+    strview v = { s, len };
+    size_t n;
+
+    if (how != STRIP_TRAILING) {
+	n = strip_lead(s, len);
+	v.ptr += n;
+	v.len -= n;
+    }
+
+    if (how != STRIP_LEADING)
+	v.len = strip_trail(v.ptr, v.len);
+
+    return v;
+}
+
+/* 
+ * In-place variant: the stripped string is moved to the start of `s' 
+ * (only if there was leading whitespace) and NUL terminated.
+ */
 char *
 strip2(char *s, int how)
 {
-    char *p;
+    strview v;
 
     if (!s) {
 	return NULL;
     }
-    
-    /* Strip leading whitespaces. */
-    if (how != STRIP_TRAILING) {
-	for (p = s; *p && isspace(*p); p++)
-	    ;			
 
-	memmove(s, p, strlen(p) + 1);
-    }
+    v = strip_view(s, strlen(s), how);
+    if (v.ptr != s)
+	memmove(s, v.ptr, v.len);
+    s[v.len] = '\0';
+
+    return s;
+}
+
+/*
+ * Batch variants, e.g. on the fields of a record. Most fields have no 
+ * padding at all: the end bytes of 4 fields at a time are tested 
+ * together, and only fields that do have whitespace go down the 
+ * scanning path.
+ */
+
+/* Whitespace at the stripped ends of `f' (0 if none). */
+#define STRIP_NEEDS(f, lead, trail)					\
+    ((f).len != 0 && ((lead & STRIP_ISSPACE((f).ptr[0]))			\
+		      | (trail & STRIP_ISSPACE((f).ptr[(f).len - 1]))))
+
+static void
+strip_one(strview *f, int how)
+{
+    *f = strip_view(f->ptr, f->len, how);
+}
 
-    /* Strip trailing whitespaces. */
-    if (how != STRIP_LEADING) {
-	for (p = s + strlen(s) - 1; p >= s && isspace(*p); p--)
-	    *p = '\0';
+/* Strip each of `fields[0..n-1]' in place; no byte is written. */
+void
+strip_views(strview *fields, size_t n, int how)
+{
+    int lead = how != STRIP_TRAILING, trail = how != STRIP_LEADING;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+	if (!(STRIP_NEEDS(fields[i], lead, trail)
+	      | STRIP_NEEDS(fields[i + 1], lead, trail)
+	      | STRIP_NEEDS(fields[i + 2], lead, trail)
+	      | STRIP_NEEDS(fields[i + 3], lead, trail)))
+	    continue;
+
+	strip_one(fields + i, how);
+	strip_one(fields + i + 1, how);
+	strip_one(fields + i + 2, how);
+	strip_one(fields + i + 3, how);
     }
 
-    return s;
+    for (; i < n; i++)
+	if (STRIP_NEEDS(fields[i], lead, trail))
+	    strip_one(fields + i, how);
+}
+
+/* 
+ * Strip each of the NUL terminated `v[0..n-1]' in place, as strip2() 
+ * does (e.g. the output of split()). NULL entries are skipped.
+ */
+void
+strip_array(char **v, size_t n, int how)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	strip2(v[i], how);
 }
 
 int
 main(void)
 {
-    char buf[] = "    a string      ";
-    
-    printf("strip = '%s'\n", strip(strdup(buf)));
-    printf("chug = '%s'\n", chug(strdup(buf)));
-    printf("chomp = '%s'\n", chomp(strdup(buf)));
+    static const char *name[] = { "strip", "chug", "chomp" };
+    static const int how[] = { STRIP_BOTH, STRIP_TRAILING, STRIP_LEADING };
+    char buf[] = "    a string      ", c0[] = " x ", c1[] = "\ty", c2[] = "z  ";
+    char *cols[] = { c0, c1, NULL, c2 };
+    const char *rec = " id ,name  ,  , x,\tlast\t", *p, *q;
+    strview v, f[8];
+    int i, n;
+
+    /* Views into `buf': nothing is copied nor written */
+    for (i = 0; i < 3; i++) {
+	v = strip_view(buf, strlen(buf), how[i]);
+	printf("%s = '%.*s'\n", name[i], (int) v.len, v.ptr);
+    }
+
+    strip_array(cols, 4, STRIP_BOTH);
+    printf("array = '%s' '%s' '%s'\n", cols[0], cols[1], cols[3]);
+
+    for (n = 0, p = rec; n < 8; p = q + 1) {
+	q = strchr(p, ',') ? strchr(p, ',') : p + strlen(p);
+	f[n].ptr = p;
+	f[n++].len = q - p;
+	if (*q == '\0')
+	    break;
+    }
+
+    strip_all(f, n);
+    for (i = 0; i < n; i++)
+	printf("field[%d] = '%.*s'\n", i, (int) f[i].len, f[i].ptr);
     return 0;
 }
 
@@ -21,43 +21,750 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
 
+/*
+ * Substring search: Crochemore-Perrin Two-Way. The pattern is split 
+ * at a critical factorization once, then every search compares the 
+ * right part left to right and the left part right to left; shifts 
+ * never move back, so a search is linear in the text scanned, 
+ * whatever the input (the old strstr() loop was quadratic), and uses 
+ * constant space. memchr() skips ahead to candidate positions.
+ */
+typedef struct _twoway twoway;
+
+struct _twoway {
+    const unsigned char *x;	/* pattern */
+    long m;			/* its length */
+    long ell;			/* critical position */
+    long per;			/* period (or shift if not periodic) */
+    int periodic;
+};
+
+/* Maximal suffix of x for the ordering `rev' (0: <, 1: >). */
+static long
+tw_maxsuf(const unsigned char *x, long m, long *p, int rev)
+{
+    long ms = -1, j = 0, k = 1;
+    unsigned char a, b;
+
+    *p = 1;
+    while (j + k < m) {
+	a = x[j + k];
+	b = x[ms + k];
+	if (rev ? a > b : a < b) {
+	    j += k;
+	    k = 1;
+	    *p = j - ms;
+	} else if (a == b) {
+	    if (k != *p) {
+		k++;
+	    } else {
+		j += *p;
+		k = 1;
+	    }
+	} else {
+	    ms = j;
+	    j = ms + 1;
+	    k = *p = 1;
+	}
+    }
+
+    return ms;
+}
+
+static void
+tw_init(twoway *t, const char *pattern, long m)
+{
+    long i, j, p, q;
+
+    t->x = (const unsigned char *) pattern;
+    t->m = m;
+
+    i = tw_maxsuf(t->x, m, &p, 0);
+    j = tw_maxsuf(t->x, m, &q, 1);
+    if (i > j) {
+	t->ell = i;
+	t->per = p;
+    } else {
+	t->ell = j;
+	t->per = q;
+    }
+
+    t->periodic = m > 0 && t->ell + t->per < m
+	&& memcmp(t->x, t->x + t->per, t->ell + 1) == 0;
+    if (!t->periodic)
+	t->per = (t->ell + 1 > m - t->ell - 1 ? t->ell + 1 : m - t->ell - 1) + 1;
+}
+
+/* Offset of the first match in y[0..n-1], or -1. */
+static long
+tw_find(const twoway *t, const unsigned char *y, long n)
+{
+    const unsigned char *x = t->x, *c;
+    long i, j = 0, m = t->m, ell = t->ell, memory = -1;
+
+    if (m == 0)
+	return 0;
+
+    while (j <= n - m) {
+	if (memory < 0) {
+	    /* Skip to where the first right part byte matches. */
+	    c = memchr(y + j + ell + 1, x[ell + 1], n - m - j + 1);
+	    if (c == NULL)
+		return -1;
+	    j = c - y - ell - 1;
+	}
+
+	i = (ell > memory ? ell : memory) + 1;
+	while (i < m && x[i] == y[i + j])
+	    i++;
+
+	if (i < m) {
+	    j += i - ell;
+	    memory = -1;
+	    continue;
+	}
+
+	i = ell;
+	while (i > memory && x[i] == y[i + j])
+	    i--;
+	if (i <= memory)
+	    return j;
+
+	j += t->per;
+	memory = t->periodic ? m - t->per - 1 : -1;
+    }
+
+    return -1;
+}
+
+/*
+ * Match offsets of one replacement: kept on the stack for the usual 
+ * small counts, on the heap past that.
+ */
+#define STRRPL_STACK   64
+
+typedef struct _strrpl_matches strrpl_matches;
+
+struct _strrpl_matches {
+    size_t *pos;
+    size_t n;
+    size_t max;
+    size_t stack[STRRPL_STACK];
+};
+
+/* 
+ * Find the non-overlapping matches of `sep' in `s', in one pass. 
+ * Returns -1 on allocation failure.
+ */
+static int
+strrpl_scan(strrpl_matches *mt, const char *s, size_t len, const char *sep, 
+	    size_t slen)
+{
+    twoway t;
+    size_t *p, off = 0;
+    long k;
+
+    mt->pos = mt->stack;
+    mt->n = 0;
+    mt->max = STRRPL_STACK;
+
+    if (slen == 0 || slen > len)
+	return 0;
+
+    tw_init(&t, sep, slen);
+
+    while ((k = tw_find(&t, (const unsigned char *) s + off, len - off)) >= 0) {
+	if (mt->n == mt->max) {
+	    if (mt->pos == mt->stack) {
+		p = malloc(mt->max * 2 * sizeof(size_t));
+		if (p)
+		    memcpy(p, mt->stack, sizeof(mt->stack));
+	    } else {
+		p = realloc(mt->pos, mt->max * 2 * sizeof(size_t));
+	    }
+	    if (p == NULL) {
+		if (mt->pos != mt->stack)
+		    free(mt->pos);
+		return -1;
+	    }
+	    mt->pos = p;
+	    mt->max *= 2;
+	}
+	mt->pos[mt->n++] = off + k;
+	off += k + slen;
+    }
+
+    return 0;
+}
+
+static void
+strrpl_release(strrpl_matches *mt)
+{
+    if (mt->pos != mt->stack)
+	free(mt->pos);
+}
+
+/* Write `s' with the matches replaced by `exp' to `out' (NUL terminated). */
+static void
+strrpl_copy(const strrpl_matches *mt, const char *s, size_t len, size_t slen, 
+	    const char *exp, size_t elen, char *out)
+{
+    size_t i, from = 0;
+
+    for (i = 0; i < mt->n; i++) {
+	memmove(out, s + from, mt->pos[i] - from);
+	out += mt->pos[i] - from;
+	memcpy(out, exp, elen);
+	out += elen;
+	from = mt->pos[i] + slen;
+    }
+
+    memmove(out, s + from, len - from);
+    out[len - from] = '\0';
+}
+
+/* 
+ * Replace every (non-overlapping, leftmost first) occurrence of `sep' 
+ * in `s' with `exp'; an empty `sep' matches nothing. The result is 
+ * allocated to its exact size. Returns NULL on allocation failure.
+ */
 char *
 strrpl(const char *s, const char *sep, const char *exp)
 {
-    int c = 0;
-    char *p, *q, *r;
-    
-    p = (char *) s;
-    
-    while ((p = strstr(p, sep))) {
-	c++;
-	p += strlen(sep);
+    strrpl_matches mt;
+    size_t len = strlen(s), slen = strlen(sep), elen = strlen(exp);
+    char *r;
+
+    if (strrpl_scan(&mt, s, len, sep, slen) < 0)
+	return NULL;
+
+    r = malloc(len - mt.n * slen + mt.n * elen + 1);
+    if (r)
+	strrpl_copy(&mt, s, len, slen, exp, elen, r);
+
+    strrpl_release(&mt);
+    return r;
+}
+
+/* 
+ * Same as strrpl(), into the caller's `buf' of `size' bytes. Returns 
+ * `buf', or NULL if it is too small (or on allocation failure).
+ */
+char *
+strrpl_buf(const char *s, const char *sep, const char *exp, char *buf, 
+	   size_t size)
+{
+    strrpl_matches mt;
+    size_t len = strlen(s), slen = strlen(sep), elen = strlen(exp);
+    char *r = NULL;
+
+    if (strrpl_scan(&mt, s, len, sep, slen) < 0)
+	return NULL;
+
+    if (len - mt.n * slen + mt.n * elen + 1 <= size) {
+	strrpl_copy(&mt, s, len, slen, exp, elen, buf);
+	r = buf;
     }
 
-    q = r = malloc(strlen(s) - (c * strlen(sep)) + (c * strlen(exp)));
-    
-    for (p = (char *) s; *p;) {
-	if (*p == *sep && strstr(p, sep)) {
-	    strcat(q, exp);
-	    p += strlen(sep);
-	    q += strlen(exp);
+    strrpl_release(&mt);
+    return r;
+}
+
+/* 
+ * Replace in place, when `exp' is not longer than `sep' (the result 
+ * cannot grow). Matches are searched and replaced in the same left to 
+ * right pass, the output trailing behind the input. Returns `s', or 
+ * NULL if `exp' is longer than `sep'.
+ */
+char *
+strrpl_inplace(char *s, const char *sep, const char *exp)
+{
+    twoway t;
+    size_t len = strlen(s), slen = strlen(sep), elen = strlen(exp);
+    char *in = s, *out = s, *end = s + len;
+    long k;
+
+    if (elen > slen)
+	return NULL;
+
+    if (slen == 0)
+	return s;
+
+    tw_init(&t, sep, slen);
+
+    while ((k = tw_find(&t, (unsigned char *) in, end - in)) >= 0) {
+	memmove(out, in, k);
+	out += k;
+	memcpy(out, exp, elen);
+	out += elen;
+	in += k + slen;
+    }
+
+    memmove(out, in, end - in + 1);
+    return s;
+}
+
+/*
+ * Streaming replacement, for inputs that do not fit in memory. Input 
+ * is fed in chunks of any size, output goes through a write callback 
+ * in blocks of STRRPL_CHUNK bytes. Between chunks only the last 
+ * strlen(sep) - 1 bytes are held back (a match cannot start earlier), 
+ * so memory stays constant; the result is the same as strrpl() on the 
+ * whole input.
+ */
+#ifndef STRRPL_CHUNK
+# define STRRPL_CHUNK  (64 * 1024)
+#endif
+
+/* Output callback: returns 0, or -1 (with errno set) to stop. */
+typedef int (*strrpl_write_fn)(void *arg, const char *buf, size_t len);
+
+typedef struct _strrpl_stream strrpl_stream;
+
+struct _strrpl_stream {
+    twoway t;
+    size_t slen;
+    const char *exp;
+    size_t elen;
+    char *in;			/* held back bytes + current chunk */
+    size_t used;
+    char *out;
+    size_t olen;
+    strrpl_write_fn fn;
+    void *arg;
+};
+
+/* Returns -1 on allocation failure. */
+int
+strrpl_stream_init(strrpl_stream *st, const char *sep, const char *exp, 
+		   strrpl_write_fn fn, void *arg)
+{
+    st->slen = strlen(sep);
+    st->exp = exp;
+    st->elen = strlen(exp);
+    st->used = st->olen = 0;
+    st->fn = fn;
+    st->arg = arg;
+    tw_init(&st->t, sep, st->slen);
+
+    st->in = malloc(st->slen + STRRPL_CHUNK);
+    st->out = malloc(STRRPL_CHUNK);
+    if (st->in == NULL || st->out == NULL) {
+	free(st->in);
+	free(st->out);
+	return -1;
+    }
+
+    return 0;
+}
+
+static int
+strrpl_emit(strrpl_stream *st, const char *buf, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+	if (st->olen == STRRPL_CHUNK) {
+	    if (st->fn(st->arg, st->out, st->olen) < 0)
+		return -1;
+	    st->olen = 0;
+	}
+	n = STRRPL_CHUNK - st->olen < len ? STRRPL_CHUNK - st->olen : len;
+	memcpy(st->out + st->olen, buf, n);
+	st->olen += n;
+	buf += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+/* Replace in the buffered input, keeping back at most `keep' bytes. */
+static int
+strrpl_drain(strrpl_stream *st, size_t keep)
+{
+    size_t off = 0, tail;
+    long k;
+
+    if (st->slen > 0)
+	while ((k = tw_find(&st->t, (unsigned char *) st->in + off, 
+			    st->used - off)) >= 0) {
+	    if (strrpl_emit(st, st->in + off, k) < 0
+		|| strrpl_emit(st, st->exp, st->elen) < 0)
+		return -1;
+	    off += k + st->slen;
+	}
+
+    tail = st->used - off > keep ? st->used - off - keep : 0;
+    if (strrpl_emit(st, st->in + off, tail) < 0)
+	return -1;
+
+    off += tail;
+    memmove(st->in, st->in + off, st->used - off);
+    st->used -= off;
+    return 0;
+}
+
+/* Returns -1 if the write callback failed. */
+int
+strrpl_stream_feed(strrpl_stream *st, const char *buf, size_t len)
+{
+    size_t n, keep = st->slen ? st->slen - 1 : 0;
+
+    while (len > 0) {
+	n = st->slen + STRRPL_CHUNK - st->used;
+	n = n < len ? n : len;
+	memcpy(st->in + st->used, buf, n);
+	st->used += n;
+	buf += n;
+	len -= n;
+
+	if (strrpl_drain(st, keep) < 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/* 
+ * Flush the held back bytes and the output, and release the stream. 
+ * Returns -1 if the write callback failed.
+ */
+int
+strrpl_stream_finish(strrpl_stream *st)
+{
+    int r;
+
+    r = strrpl_drain(st, 0);
+    if (r == 0 && st->olen > 0)
+	r = st->fn(st->arg, st->out, st->olen);
+
+    free(st->in);
+    free(st->out);
+    return r;
+}
+
+static int
+strrpl_write_fd(void *arg, const char *buf, size_t len)
+{
+    int fd = *(int *) arg;
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = write(fd, buf, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+/* 
+ * Copy `in' to `out' replacing `sep' with `exp', in constant memory. 
+ * Returns -1 (with errno set) on error.
+ */
+int
+strrpl_fd(int in, int out, const char *sep, const char *exp)
+{
+    strrpl_stream st;
+    char *buf;
+    ssize_t n;
+    int r = 0;
+
+    if ((buf = malloc(STRRPL_CHUNK)) == NULL)
+	return -1;
+
+    if (strrpl_stream_init(&st, sep, exp, strrpl_write_fd, &out) < 0) {
+	free(buf);
+	return -1;
+    }
+
+    for (;;) {
+	if ((n = read(in, buf, STRRPL_CHUNK)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    r = -1;
+	    break;
+	}
+	if (n == 0 || (r = strrpl_stream_feed(&st, buf, n)) < 0)
+	    break;
+    }
+
+    if (strrpl_stream_finish(&st) < 0)
+	r = -1;
+
+    free(buf);
+    return r;
+}
+
+/*
+ * Multi-pattern replacement. An Aho-Corasick automaton is built once 
+ * from a table of (pattern, replacement) pairs, then every pattern is 
+ * replaced with non-overlapping leftmost matches:
+ *
+ *   - STRRPL_LONGEST: at the leftmost position where a pattern 
+ *     matches, the longest one wins;
+ *   - STRRPL_FIRST: at that position, the first one of the table wins.
+ *
+ * Which match wins at a position depends on the bytes after it, up to 
+ * the longest pattern, so a forward scan would have to look ahead and 
+ * scan again after each match. The automaton is built instead on the 
+ * reversed patterns, and every state knows the pattern that wins among 
+ * those it ends: one right to left pass (the state carrying over from 
+ * byte to byte) gives the winner starting at each position, then a 
+ * left to right pass takes the matches. Both are linear in the input.
+ *
+ * The automaton is a full transition table (256 entries per state, 
+ * i.e. 1KB per pattern byte), so the scan costs one lookup per byte.
+ */
+#define STRRPL_LONGEST 0
+#define STRRPL_FIRST   1
+
+typedef struct _strrpl_pair strrpl_pair;
+
+struct _strrpl_pair {
+    const char *from;
+    const char *to;
+};
+
+typedef struct _ac_state ac_state;
+
+struct _ac_state {
+    int next[256];
+    int fail;
+    int out;			/* pattern ending here, -1 if none */
+    int pick;			/* winner among out on the fail chain, or -1 */
+};
+
+typedef struct _acmatcher acmatcher;
+
+struct _acmatcher {
+    ac_state *states;
+    int nstates;
+    const strrpl_pair *pairs;	/* not copied */
+    size_t *from_len;
+    size_t *to_len;
+    int npairs;
+    int mode;
+};
+
+void
+ac_free(acmatcher *ac)
+{
+    if (ac) {
+	free(ac->states);
+	free(ac->from_len);
+	free(ac->to_len);
+	free(ac);
+    }
+}
+
+/* 
+ * Build the automaton for `pairs[0..n-1]', which must stay valid while 
+ * it is used; empty patterns are ignored. Returns NULL on allocation 
+ * failure.
+ */
+acmatcher *
+ac_new(const strrpl_pair *pairs, int n, int mode)
+{
+    acmatcher *ac;
+    ac_state *st;
+    const unsigned char *p;
+    int i, c, s, t, f, max = 1, *queue, head = 0, tail = 0;
+
+    if ((ac = calloc(1, sizeof(acmatcher))) == NULL)
+	return NULL;
+
+    ac->pairs = pairs;
+    ac->npairs = n;
+    ac->mode = mode;
+    ac->from_len = malloc((n ? n : 1) * sizeof(size_t));
+    ac->to_len = malloc((n ? n : 1) * sizeof(size_t));
+    for (i = 0; i < n; i++)
+	max += strlen(pairs[i].from);
+    ac->states = malloc(max * sizeof(ac_state));
+    queue = malloc(max * sizeof(int));
+
+    if (!ac->from_len || !ac->to_len || !ac->states || !queue) {
+	free(queue);
+	ac_free(ac);
+	return NULL;
+    }
+
+    /* Trie of the reversed patterns; -1 marks a missing transition. */
+    st = ac->states;
+    memset(st, -1, sizeof(ac_state));
+    ac->nstates = 1;
+
+    for (i = 0; i < n; i++) {
+	ac->from_len[i] = strlen(pairs[i].from);
+	ac->to_len[i] = strlen(pairs[i].to);
+
+	s = 0;
+	for (p = (const unsigned char *) pairs[i].from + ac->from_len[i]; 
+	     p-- > (const unsigned char *) pairs[i].from; ) {
+	    if (st[s].next[*p] < 0) {
+		t = ac->nstates++;
+		memset(st + t, -1, sizeof(ac_state));
+		st[s].next[*p] = t;
+	    }
+	    s = st[s].next[*p];
+	}
+
+	/* The same pattern twice: the first one is kept. */
+	if (s && st[s].out < 0)
+	    st[s].out = i;
+    }
+
+    /* 
+     * Breadth first: failure links, the full table and the winners. 
+     * The fail chain of a state holds the shorter patterns it ends; 
+     * the state's own pattern, if any, is the longest of them.
+     */
+    st[0].fail = 0;
+    for (c = 0; c < 256; c++) {
+	if (st[0].next[c] < 0) {
+	    st[0].next[c] = 0;
 	} else {
-	    *q++ = *p++;
+	    t = st[0].next[c];
+	    st[t].fail = 0;
+	    queue[tail++] = t;
 	}
     }
-    
+
+    while (head < tail) {
+	s = queue[head++];
+	f = st[st[s].fail].pick;
+	if (st[s].out < 0)
+	    st[s].pick = f;
+	else if (mode == STRRPL_FIRST && f >= 0 && f < st[s].out)
+	    st[s].pick = f;
+	else
+	    st[s].pick = st[s].out;
+
+	for (c = 0; c < 256; c++) {
+	    t = st[s].next[c];
+	    if (t < 0) {
+		st[s].next[c] = st[st[s].fail].next[c];
+	    } else {
+		st[t].fail = st[st[s].fail].next[c];
+		queue[tail++] = t;
+	    }
+	}
+    }
+
+    free(queue);
+    return ac;
+}
+
+/* 
+ * Replace every pattern of `ac' in `s'. The result is allocated to its 
+ * exact size. Returns NULL on allocation failure.
+ */
+char *
+ac_replace(const acmatcher *ac, const char *s)
+{
+    const ac_state *st = ac->states;
+    const unsigned char *y = (const unsigned char *) s;
+    size_t len = strlen(s), i, size, from;
+    int stack[STRRPL_STACK * 4], *at = stack, state = 0, k;
+    char *r, *out;
+
+    /* at[i]: the pattern that wins starting at i, or -1. */
+    if (len > sizeof(stack) / sizeof(int) 
+	&& (at = malloc(len * sizeof(int))) == NULL)
+	return NULL;
+
+    for (i = len; i-- > 0; ) {
+	state = st[state].next[y[i]];
+	at[i] = st[state].pick;
+    }
+
+    /* Leftmost matches, each one resuming after the previous one. */
+    for (size = len, i = 0; i < len; )
+	if ((k = at[i]) >= 0) {
+	    size += ac->to_len[k] - ac->from_len[k];
+	    i += ac->from_len[k];
+	} else {
+	    i++;
+	}
+
+    if ((r = out = malloc(size + 1)) != NULL) {
+	for (from = 0, i = 0; i < len; ) {
+	    if ((k = at[i]) < 0) {
+		i++;
+		continue;
+	    }
+	    memcpy(out, s + from, i - from);
+	    out += i - from;
+	    memcpy(out, ac->pairs[k].to, ac->to_len[k]);
+	    out += ac->to_len[k];
+	    from = i += ac->from_len[k];
+	}
+	memcpy(out, s + from, len - from);
+	out[len - from] = '\0';
+    }
+
+    if (at != stack)
+	free(at);
     return r;
 }
 
 int 
 main(int argc, char **argv)
 {
-    if (argc != 4) {
-	printf("usage: strrpl input from to\n");
+    strrpl_pair *pairs;
+    acmatcher *ac;
+    char *r;
+    int i, n;
+
+    if (argc == 3) {
+	/* Filter: strrpl from to < in > out */
+	if (strrpl_fd(0, 1, argv[1], argv[2]) < 0) {
+	    perror("strrpl");
+	    exit(1);
+	}
+	return 0;
+    }
+
+    if (argc < 4 || argc % 2) {
+	printf("usage: strrpl input from to [from to ...]\n"
+	       "       strrpl from to < in > out\n");
 	exit(1);
     }
+
+    if (argc == 4) {
+	r = strrpl(argv[1], argv[2], argv[3]);
+    } else {
+	n = (argc - 2) / 2;
+	if ((pairs = malloc(n * sizeof(strrpl_pair))) == NULL) {
+	    perror("strrpl");
+	    exit(1);
+	}
+	for (i = 0; i < n; i++) {
+	    pairs[i].from = argv[2 + 2 * i];
+	    pairs[i].to = argv[3 + 2 * i];
+	}
+	r = NULL;
+	if ((ac = ac_new(pairs, n, STRRPL_LONGEST)) != NULL)
+	    r = ac_replace(ac, argv[1]);
+	ac_free(ac);
+	free(pairs);
+    }
     
-    puts(strrpl(argv[1], argv[2], argv[3]));
+    if (r == NULL) {
+	perror("strrpl");
+	exit(1);
+    }
+
+    puts(r);
+    free(r);
     return 0;
 }
@@ -18,21 +18,47 @@
  * MA 02110-1301 USA
  */
 
+#define _GNU_SOURCE		/* for pthread_setaffinity_np() */
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
 #include <time.h>              
-#include <sys/time.h>          
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+# include <x86intrin.h>
+#endif
+#ifdef __linux__
+# include <sched.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+#endif
 
 typedef struct _timer timer;
 
 struct _timer {
-    struct timeval t_start;
-    struct timeval t_end;
+    struct timespec t_start;
+    struct timespec t_end;
     double t_total;
 };
 
-/* Microseconds per second. */
-#define USEC_PER_SEC   1000000
+/* Nanoseconds per second. */
+#define NSEC_PER_SEC   1000000000L
+
+/* 
+ * CLOCK_MONOTONIC_RAW is neither stepped nor slewed by NTP, so two 
+ * readings always measure the same kind of interval. 
+ */
+#ifdef CLOCK_MONOTONIC_RAW
+# define TIMER_CLOCK   CLOCK_MONOTONIC_RAW
+#else
+# define TIMER_CLOCK   CLOCK_MONOTONIC
+#endif
 
 #define TIMER_INIT(timer) \
     do {						\
@@ -42,22 +68,17 @@ struct _timer {
 
 #define TIMER_START(timer) \
     do {					\
-        gettimeofday(&(timer).t_start, NULL);   \
+        clock_gettime(TIMER_CLOCK, &(timer).t_start);   \
     } while (0)
 
 #define TIMER_STOP(timer) \
     do {                                                                \
-        struct timeval elapsed;                                         \
-        gettimeofday(&(timer).t_end, NULL);                             \
-        if ((timer).t_start.tv_usec > (timer).t_end.tv_usec) {          \
-            (timer).t_end.tv_usec += USEC_PER_SEC;                      \
-            (timer).t_end.tv_sec--;                                     \
-        }                                                               \
-        elapsed.tv_usec = (timer).t_end.tv_usec - (timer).t_start.tv_usec; \
-        elapsed.tv_sec = (timer).t_end.tv_sec - (timer).t_start.tv_sec; \
-        (timer).t_total = elapsed.tv_sec + ((double) elapsed.tv_usec / USEC_PER_SEC); \
+        clock_gettime(TIMER_CLOCK, &(timer).t_end);                     \
+        (timer).t_total = ((timer).t_end.tv_sec - (timer).t_start.tv_sec) \
+            + (double) ((timer).t_end.tv_nsec - (timer).t_start.tv_nsec) / NSEC_PER_SEC; \
     } while(0)
 
+/* Total time, in seconds, of `times' calls to `fptr'. */
 double 
 timeit(void (*fptr)(void), int times)
 {
@@ -75,12 +96,922 @@ timeit(void (*fptr)(void), int times)
     return timer.t_total;
 }
 
+/*
+ * Benchmark harness. timeit() gives one total over a fixed number of 
+ * calls; bench() instead:
+ *
+ *   1. runs `fptr' for `warmup' seconds (caches, branch predictors, 
+ *      CPU frequency);
+ *   2. calibrates the number of calls per sample so that a sample 
+ *      lasts about `sample_time' seconds, which makes the timer 
+ *      resolution and overhead negligible;
+ *   3. takes `samples' samples and reports per call statistics.
+ *
+ * With BENCH_TSC samples are read with rdtscp, converted to 
+ * nanoseconds with a TSC frequency measured against TIMER_CLOCK.
+ *
+ * With BENCH_COUNTERS the samples also run under hardware performance 
+ * counters (Linux perf_event_open(), user space only), reported per 
+ * call. Counters the kernel or the CPU refuses are reported as -1; if 
+ * none can be opened only the times are reported.
+ */
+#define BENCH_TSC      1
+#define BENCH_COUNTERS 2
+
+/* Hardware counters, index in bench_result.counter[]. */
+#define BENCH_CYCLES        0
+#define BENCH_INSTRUCTIONS  1
+#define BENCH_BRANCH_MISSES 2
+#define BENCH_L1D_MISSES    3
+#define BENCH_LLC_MISSES    4
+#define BENCH_NCOUNTERS     5
+
+typedef struct _bench_opts bench_opts;
+
+struct _bench_opts {
+    double warmup;		/* seconds */
+    double sample_time;		/* seconds */
+    int samples;
+    int flags;			/* BENCH_TSC, BENCH_COUNTERS */
+};
+
+#define BENCH_DEFAULTS { 0.1, 0.01, 50, 0 }
+
+typedef struct _bench_result bench_result;
+
+struct _bench_result {
+    long iterations;		/* calls per sample */
+    int samples;
+    double min;			/* nanoseconds per call */
+    double median;
+    double p99;
+    double mean;
+    double stddev;
+    double *sample;		/* `samples' values, sorted */
+    double counter[BENCH_NCOUNTERS];	/* per call, -1 if not available */
+    double ipc;			/* instructions per cycle, -1 if not available */
+};
+
+/* Timestamp in nanoseconds. */
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(TIMER_CLOCK, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+/* rdtscp waits for the previous instructions to complete. */
+static unsigned long long
+bench_tsc(void)
+{
+    unsigned int aux;
+
+    return __rdtscp(&aux);
+}
+
+/* TSC ticks per nanosecond, measured once over ~10ms. */
+static double
+bench_tsc_ghz(void)
+{
+    static double ghz;
+    double t0, t1;
+    unsigned long long c0, c1;
+
+    if (ghz == 0) {
+	t0 = bench_now();
+	c0 = bench_tsc();
+	do
+	    t1 = bench_now();
+	while (t1 - t0 < 1e7);
+	c1 = bench_tsc();
+	ghz = (c1 - c0) / (t1 - t0);
+    }
+
+    return ghz;
+}
+#endif
+
+/* Duration of `n' calls to `fptr', in nanoseconds. */
+static double
+bench_run(void (*fptr)(void), long n, int flags)
+{
+    double t;
+    long i;
+
+#if defined(__x86_64__)
+    if (flags & BENCH_TSC) {
+	unsigned long long c = bench_tsc();
+
+	for (i = 0; i < n; i++)
+	    fptr();
+	return (bench_tsc() - c) / bench_tsc_ghz();
+    }
+#else
+    (void) flags;
+#endif
+
+    t = bench_now();
+    for (i = 0; i < n; i++)
+	fptr();
+    return bench_now() - t;
+}
+
+#ifdef __linux__
+/* Event type and config of each counter. */
+static const struct {
+    unsigned int type;
+    unsigned long long config;
+} bench_events[BENCH_NCOUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D 
+      | PERF_COUNT_HW_CACHE_OP_READ << 8 
+      | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+#endif
+
+/* 
+ * Open the counters as one group, so they all count over the same 
+ * interval, and start them. fd[i] is -1 for the counters that could 
+ * not be opened. Returns the group leader, or -1 if nothing could be 
+ * opened.
+ */
+static int
+bench_counters_open(int *fd)
+{
+    int i, leader = -1;
+
+    for (i = 0; i < BENCH_NCOUNTERS; i++)
+	fd[i] = -1;
+
+#ifdef __linux__
+    for (i = 0; i < BENCH_NCOUNTERS; i++) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = bench_events[i].type;
+	attr.config = bench_events[i].config;
+	attr.disabled = leader == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID 
+	    | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+	if (fd[i] != -1 && leader == -1)
+	    leader = fd[i];
+    }
+
+    if (leader != -1)
+	ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+
+    return leader;
+}
+
+/* 
+ * Read the group into r->counter[], divided by `calls' and scaled up 
+ * if the kernel had to multiplex the counters. Closes the counters.
+ */
+static void
+bench_counters_close(int leader, int *fd, double calls, bench_result *r)
+{
+    int i;
+
+    for (i = 0; i < BENCH_NCOUNTERS; i++)
+	r->counter[i] = -1;
+    r->ipc = -1;
+
+#ifdef __linux__
+    if (leader != -1) {
+	/* nr, time_enabled, time_running, then (value, id) pairs. */
+	unsigned long long buf[3 + 2 * BENCH_NCOUNTERS], id[BENCH_NCOUNTERS];
+	double scale;
+	int j;
+
+	ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	for (i = 0; i < BENCH_NCOUNTERS; i++)
+	    if (fd[i] == -1 || ioctl(fd[i], PERF_EVENT_IOC_ID, id + i) == -1)
+		id[i] = (unsigned long long) -1;
+
+	if (read(leader, buf, sizeof(buf)) > 0 && buf[2] > 0) {
+	    scale = (double) buf[1] / buf[2];
+	    for (j = 0; j < (int) buf[0]; j++)
+		for (i = 0; i < BENCH_NCOUNTERS; i++)
+		    if (id[i] == buf[4 + 2 * j])
+			r->counter[i] = buf[3 + 2 * j] * scale / calls;
+	}
+    }
+#else
+    (void) leader;
+    (void) calls;
+#endif
+
+    for (i = 0; i < BENCH_NCOUNTERS; i++)
+	if (fd[i] != -1)
+	    close(fd[i]);
+
+    if (r->counter[BENCH_CYCLES] > 0 && r->counter[BENCH_INSTRUCTIONS] >= 0)
+	r->ipc = r->counter[BENCH_INSTRUCTIONS] / r->counter[BENCH_CYCLES];
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Warm up, then return the number of calls that make a sample. */
+static long
+bench_calibrate(void (*fptr)(void), const bench_opts *opts)
+{
+    double t;
+    long n;
+
+    for (t = bench_now(); bench_now() - t < opts->warmup * 1e9;)
+	fptr();
+
+    /* Double the calls until a sample is long enough. */
+    for (n = 1; bench_run(fptr, n, opts->flags) < opts->sample_time * 1e9 
+	     && n < LONG_MAX / 2; n *= 2)
+	;
+
+    return n;
+}
+
+/* Sort r->sample and compute the statistics from it. */
+static void
+bench_summary(bench_result *r)
+{
+    double sum = 0, sq = 0;
+    int i;
+
+    for (i = 0; i < r->samples; i++) {
+	sum += r->sample[i];
+	sq += r->sample[i] * r->sample[i];
+    }
+
+    qsort(r->sample, r->samples, sizeof(double), bench_cmp);
+    r->min = r->sample[0];
+    r->median = r->sample[r->samples / 2];
+    r->p99 = r->sample[(int) ((r->samples - 1) * 0.99)];
+    r->mean = sum / r->samples;
+    r->stddev = r->samples > 1 
+	? sqrt(fabs(sq - sum * sum / r->samples) / (r->samples - 1)) : 0;
+}
+
+void
+bench_free(bench_result *r)
+{
+    free(r->sample);
+    r->sample = NULL;
+}
+
+/* 
+ * Benchmark `fptr'; `opts' may be NULL for BENCH_DEFAULTS. Returns 0 
+ * on success, -1 on allocation failure. Release `r' with bench_free().
+ */
+int
+bench(void (*fptr)(void), const bench_opts *opts, bench_result *r)
+{
+    static const bench_opts defaults = BENCH_DEFAULTS;
+    long n;
+    int i, leader = -1, fd[BENCH_NCOUNTERS];
+
+    if (opts == NULL)
+	opts = &defaults;
+
+    memset(r, 0, sizeof(*r));
+    if ((r->sample = malloc(opts->samples * sizeof(double))) == NULL)
+	return -1;
+    r->samples = opts->samples;
+    r->iterations = n = bench_calibrate(fptr, opts);
+
+    if (opts->flags & BENCH_COUNTERS)
+	leader = bench_counters_open(fd);
+
+    for (i = 0; i < r->samples; i++)
+	r->sample[i] = bench_run(fptr, n, opts->flags) / n;
+
+    bench_counters_close(leader, fd, (double) n * r->samples, r);
+    bench_summary(r);
+    return 0;
+}
+
+/*
+ * Scaling mode: run `fptr' on 1, 2, ..., `maxthreads' threads at once, 
+ * each pinned to its own CPU among those the process may run on 
+ * (wrapping around if there are fewer) and released together once all 
+ * of them are ready. Every thread takes opts->samples samples of the 
+ * single thread calibrated size, and for each thread count r[t - 1] 
+ * holds:
+ *
+ *   - throughput: calls per second of all threads together, over the 
+ *     wall time from the first thread leaving the barrier to the last 
+ *     one finishing;
+ *   - efficiency: throughput / (t * single thread throughput), 1 for 
+ *     perfect scaling; contention and false sharing push it down;
+ *   - latency: per call statistics of the samples of all threads;
+ *   - pinned: 0 if some thread could not be pinned (the scheduler was 
+ *     free to move the threads around, or stack them on one CPU).
+ */
+typedef struct _bench_scaling bench_scaling;
+
+struct _bench_scaling {
+    int threads;
+    double throughput;		/* calls per second */
+    double efficiency;
+    bench_result latency;
+    int pinned;
+};
+
+void
+bench_scaling_free(bench_scaling *r, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	bench_free(&r[i].latency);
+}
+
+/* 
+ * Start barrier. Unlike a pthread_barrier_t it can also be opened 
+ * with `go' < 0, to dismiss the threads already waiting when creating 
+ * the others failed.
+ */
+typedef struct _bench_gate bench_gate;
+
+struct _bench_gate {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int waiting;		/* threads at the gate */
+    int go;			/* 0 closed, 1 run, -1 give up */
+};
+
+typedef struct _bench_thread bench_thread;
+
+struct _bench_thread {
+    pthread_t tid;
+    void (*fptr)(void);
+    const bench_opts *opts;
+    long n;
+    int cpu;			/* -1 not to pin the thread */
+    int pinned;
+    bench_gate *gate;
+    double start;		/* bench_now() when released */
+    double *sample;		/* opts->samples values */
+};
+
+/* Open the gate with `go' once `n' threads are waiting at it. */
+static void
+bench_gate_open(bench_gate *g, int n, int go)
+{
+    pthread_mutex_lock(&g->lock);
+    while (g->waiting < n)
+	pthread_cond_wait(&g->cond, &g->lock);
+    g->go = go;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+}
+
+static void *
+bench_thread_main(void *arg)
+{
+    bench_thread *t = arg;
+    int i;
+
+    t->pinned = 0;
+#ifdef __linux__
+    if (t->cpu >= 0) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	t->pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+#endif
+
+    pthread_mutex_lock(&t->gate->lock);
+    t->gate->waiting++;
+    pthread_cond_broadcast(&t->gate->cond);
+    while (t->gate->go == 0)
+	pthread_cond_wait(&t->gate->cond, &t->gate->lock);
+    pthread_mutex_unlock(&t->gate->lock);
+
+    if (t->gate->go < 0)
+	return NULL;
+
+    t->start = bench_now();
+    for (i = 0; i < t->opts->samples; i++)
+	t->sample[i] = bench_run(t->fptr, t->n, t->opts->flags) / t->n;
+
+    return NULL;
+}
+
+/* 
+ * The first `max' CPUs the process may run on, in cpu[]. Returns how 
+ * many, 0 if that is unknown (and the threads are not pinned).
+ */
+static int
+bench_cpus(int *cpu, int max)
+{
+    int n = 0;
+
+#ifdef __linux__
+    cpu_set_t set;
+    int i;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	for (i = 0; i < CPU_SETSIZE && n < max; i++)
+	    if (CPU_ISSET(i, &set))
+		cpu[n++] = i;
+#else
+    (void) cpu;
+    (void) max;
+#endif
+
+    return n;
+}
+
+/* 
+ * Fill r[0..maxthreads-1]; `opts' may be NULL for BENCH_DEFAULTS 
+ * (BENCH_COUNTERS is ignored). Returns 0 on success, -1 on failure. 
+ * Release with bench_scaling_free().
+ */
+int
+bench_threads(void (*fptr)(void), const bench_opts *opts, int maxthreads, 
+	      bench_scaling *r)
+{
+    static const bench_opts defaults = BENCH_DEFAULTS;
+    bench_gate gate = { 
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 
+    };
+    bench_thread *th;
+    double start;
+    long n;
+    int i, k, nt, ncpu, *cpu;
+
+    if (opts == NULL)
+	opts = &defaults;
+
+    memset(r, 0, maxthreads * sizeof(bench_scaling));
+    th = calloc(maxthreads, sizeof(bench_thread));
+    cpu = calloc(maxthreads, sizeof(int));
+    if (th == NULL || cpu == NULL) {
+	free(th);
+	free(cpu);
+	return -1;
+    }
+
+    ncpu = bench_cpus(cpu, maxthreads);
+    n = bench_calibrate(fptr, opts);
+
+    for (nt = 1; nt <= maxthreads; nt++) {
+	bench_result *l = &r[nt - 1].latency;
+
+	r[nt - 1].threads = nt;
+	l->samples = nt * opts->samples;
+	l->iterations = n;
+	for (i = 0; i < BENCH_NCOUNTERS; i++)
+	    l->counter[i] = -1;
+	l->ipc = -1;
+	if ((l->sample = malloc(l->samples * sizeof(double))) == NULL)
+	    goto fail;
+
+	gate.waiting = gate.go = 0;
+	for (i = 0; i < nt; i++) {
+	    th[i].fptr = fptr;
+	    th[i].opts = opts;
+	    th[i].n = n;
+	    th[i].cpu = ncpu ? cpu[i % ncpu] : -1;
+	    th[i].gate = &gate;
+	    th[i].sample = l->sample + i * opts->samples;
+	    if (pthread_create(&th[i].tid, NULL, bench_thread_main, th + i) != 0) {
+		/* Dismiss the threads already waiting, then give up. */
+		bench_gate_open(&gate, i, -1);
+		for (k = 0; k < i; k++)
+		    pthread_join(th[k].tid, NULL);
+		goto fail;
+	    }
+	}
+
+	bench_gate_open(&gate, nt, 1);
+	r[nt - 1].pinned = 1;
+	for (i = 0; i < nt; i++)
+	    pthread_join(th[i].tid, NULL);
+	for (i = 0, start = th[0].start; i < nt; i++) {
+	    if (th[i].start < start)
+		start = th[i].start;
+	    r[nt - 1].pinned &= th[i].pinned;
+	}
+	r[nt - 1].throughput = (double) nt * opts->samples * n 
+	    / (bench_now() - start) * 1e9;
+
+	r[nt - 1].efficiency = r[nt - 1].throughput / (nt * r[0].throughput);
+	bench_summary(l);
+    }
+
+    free(th);
+    free(cpu);
+    return 0;
+
+fail:
+    free(th);
+    free(cpu);
+    bench_scaling_free(r, maxthreads);
+    return -1;
+}
+
+/* Print one line of results, plus one of counters if there are any. */
+void
+bench_print(const char *name, const bench_result *r)
+{
+    static const char *names[BENCH_NCOUNTERS] = {
+	"cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses"
+    };
+    int i, n;
+
+    printf("%-12s %10.2f %10.2f %10.2f %10.2f  (%d x %ld calls)\n", name, 
+	   r->min, r->median, r->p99, r->stddev, r->samples, r->iterations);
+
+    for (i = 0, n = 0; i < BENCH_NCOUNTERS; i++)
+	if (r->counter[i] >= 0)
+	    n += printf("%s %s %.2f", n ? "," : "            ", names[i], 
+			r->counter[i]);
+    if (r->ipc >= 0)
+	printf(", IPC %.2f", r->ipc);
+    if (n)
+	printf("  (per call)\n");
+}
+
+/*
+ * Benchmark registry and result files. Registered benchmarks are run 
+ * in order by bench_all(); their results can be saved as JSON or CSV 
+ * and compared with a previous run (either format) by bench_compare().
+ */
+#define BENCH_MAX      64
+
+typedef struct _bench_entry bench_entry;
+
+struct _bench_entry {
+    const char *name;
+    void (*fptr)(void);
+    bench_result result;
+};
+
+static bench_entry bench_registry[BENCH_MAX];
+static int bench_count;
+
+/* Returns 0 on success, -1 if the registry is full. */
+int
+bench_register(const char *name, void (*fptr)(void))
+{
+    if (bench_count == BENCH_MAX)
+	return -1;
+
+    bench_registry[bench_count].name = name;
+    bench_registry[bench_count].fptr = fptr;
+    bench_count++;
+    return 0;
+}
+
+/* Run and print every registered benchmark. Returns -1 if one failed. */
+int
+bench_all(const bench_opts *opts)
+{
+    int i, ret = 0;
+
+    printf("%-12s %10s %10s %10s %10s  (ns per call)\n", 
+	   "", "min", "median", "p99", "stddev");
+
+    for (i = 0; i < bench_count; i++) {
+	if (bench(bench_registry[i].fptr, opts, &bench_registry[i].result) < 0) {
+	    ret = -1;
+	    continue;
+	}
+	bench_print(bench_registry[i].name, &bench_registry[i].result);
+    }
+
+    return ret;
+}
+
+/* Print `s' as a JSON string. */
+static void
+bench_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\')
+	    fputc('\\', fp);
+	fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/* 
+ * Save the results: one object per benchmark with its statistics and 
+ * raw samples (JSON), or one "name,sample,ns" row per sample (CSV). 
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int
+bench_save(const char *path, int json)
+{
+    FILE *fp;
+    bench_result *r;
+    int i, j;
+
+    if ((fp = fopen(path, "w")) == NULL)
+	return -1;
+
+    if (json)
+	fprintf(fp, "{\n  \"benchmarks\": [");
+    else
+	fprintf(fp, "name,sample,ns\n");
+
+    for (i = 0; i < bench_count; i++) {
+	r = &bench_registry[i].result;
+
+	if (!json) {
+	    for (j = 0; j < r->samples; j++)
+		fprintf(fp, "%s,%d,%.17g\n", bench_registry[i].name, j, 
+			r->sample[j]);
+	    continue;
+	}
+
+	fprintf(fp, "%s\n    {\n      \"name\": ", i ? "," : "");
+	bench_json_string(fp, bench_registry[i].name);
+	fprintf(fp, ",\n      \"iterations\": %ld,\n"
+		"      \"min\": %.17g,\n      \"median\": %.17g,\n"
+		"      \"p99\": %.17g,\n      \"mean\": %.17g,\n"
+		"      \"stddev\": %.17g,\n      \"samples\": [", 
+		r->iterations, r->min, r->median, r->p99, r->mean, r->stddev);
+	for (j = 0; j < r->samples; j++)
+	    fprintf(fp, "%s%.17g", j ? ", " : "", r->sample[j]);
+	fprintf(fp, "]\n    }");
+    }
+
+    if (json)
+	fprintf(fp, "\n  ]\n}\n");
+
+    return fclose(fp) == EOF ? -1 : 0;
+}
+
+/* Samples of one benchmark of a baseline file. */
+typedef struct _bench_baseline bench_baseline;
+
+struct _bench_baseline {
+    char name[64];
+    int samples;
+    double *sample;
+};
+
+/* Append `v' to the samples of `b'. */
+static int
+bench_baseline_add(bench_baseline *b, double v)
+{
+    double *p;
+
+    if ((b->samples & (b->samples - 1)) == 0) {
+	p = realloc(b->sample, (b->samples ? b->samples * 2 : 1) * sizeof(double));
+	if (p == NULL)
+	    return -1;
+	b->sample = p;
+    }
+
+    b->sample[b->samples++] = v;
+    return 0;
+}
+
+/* Baseline entry named `name', added if missing; NULL when full. */
+static bench_baseline *
+bench_baseline_get(bench_baseline *base, int *n, const char *name)
+{
+    int i;
+
+    for (i = 0; i < *n; i++)
+	if (strcmp(base[i].name, name) == 0)
+	    return base + i;
+
+    if (*n == BENCH_MAX)
+	return NULL;
+
+    memset(base + *n, 0, sizeof(bench_baseline));
+    snprintf(base[*n].name, sizeof(base[*n].name), "%s", name);
+    return base + (*n)++;
+}
+
+/* 
+ * Undo bench_json_string() in place on the string starting at `p', 
+ * just after its opening quote. Returns the character following the 
+ * closing quote, NULL if the string is not terminated.
+ */
+static char *
+bench_json_unescape(char *p)
+{
+    char *q = p;
+
+    for (; *p != '"'; p++, q++) {
+	if (*p == '\\')
+	    p++;
+	if (*p == '\0')
+	    return NULL;
+	*q = *p;
+    }
+    *q = '\0';
+
+    return p + 1;
+}
+
+/* 
+ * Load a file written by bench_save(), JSON or CSV. The JSON reader 
+ * only understands that layout: a "name" followed by its "samples". 
+ * Returns the number of benchmarks, -1 on failure.
+ */
+static int
+bench_load(const char *path, bench_baseline *base)
+{
+    FILE *fp;
+    bench_baseline *b;
+    char *buf, *p, *q, name[64];
+    long size;
+    double v;
+    int n = 0, ret = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	return -1;
+
+    if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1
+	|| (buf = malloc(size + 1)) == NULL) {
+	fclose(fp);
+	return -1;
+    }
+    rewind(fp);
+    buf[fread(buf, 1, size, fp)] = '\0';
+    fclose(fp);
+
+    if (strchr(buf, '{') == NULL) {
+	/* CSV; the header does not scan. */
+	for (p = strtok(buf, "\n"); p && ret == 0; p = strtok(NULL, "\n"))
+	    if (sscanf(p, "%63[^,],%*d,%lf", name, &v) == 2
+		&& ((b = bench_baseline_get(base, &n, name)) == NULL
+		    || bench_baseline_add(b, v) < 0))
+		ret = -1;
+    } else {
+	for (p = buf; ret == 0 && (p = strstr(p, "\"name\": \"")) != NULL;) {
+	    p += 9;
+	    if ((q = bench_json_unescape(p)) == NULL) {
+		ret = -1;
+		break;
+	    }
+	    if ((b = bench_baseline_get(base, &n, p)) == NULL
+		|| (p = strstr(q, "\"samples\": [")) == NULL) {
+		ret = -1;
+		break;
+	    }
+	    for (p += 12; ret == 0; p = q) {
+		v = strtod(p, &q);
+		if (q == p)
+		    break;
+		ret = bench_baseline_add(b, v);
+		while (*q == ',' || *q == ' ' || *q == '\n')
+		    q++;
+	    }
+	}
+    }
+
+    free(buf);
+    if (ret < 0) {
+	while (n > 0)
+	    free(base[--n].sample);
+	return -1;
+    }
+
+    return n;
+}
+
+/*
+ * One-sided Mann-Whitney U test: probability of seeing `y' rank this 
+ * high against `x' if both came from the same distribution (normal 
+ * approximation, with tie correction). A small value means `y' is 
+ * significantly larger (slower) than `x'.
+ */
+static double
+bench_mann_whitney(const double *x, int nx, const double *y, int ny)
+{
+    double *v, ry = 0, ties = 0, u, mu, sigma, rank;
+    int *from_y, n = nx + ny, i, j, k;
+
+    if ((v = malloc(n * sizeof(double))) == NULL
+	|| (from_y = malloc(n * sizeof(int))) == NULL) {
+	free(v);
+	return 1;
+    }
+
+    /* Merge the (sorted) samples, remembering where each came from. */
+    for (i = j = k = 0; k < n; k++) {
+	from_y[k] = i == nx || (j < ny && y[j] < x[i]);
+	v[k] = from_y[k] ? y[j++] : x[i++];
+    }
+
+    /* Sum of the ranks of `y', ties getting their average rank. */
+    for (i = 0; i < n; i = j) {
+	for (j = i + 1; j < n && v[j] == v[i]; j++)
+	    ;
+	rank = (i + 1 + j) / 2.0;
+	for (k = i; k < j; k++)
+	    if (from_y[k])
+		ry += rank;
+	ties += (double) (j - i) * (j - i) * (j - i) - (j - i);
+    }
+
+    free(v);
+    free(from_y);
+
+    u = ry - ny * (ny + 1) / 2.0;
+    mu = nx * (double) ny / 2;
+    sigma = sqrt(nx * (double) ny / 12 * ((n + 1) - ties / ((double) n * (n - 1))));
+
+    /* With a continuity correction. */
+    return sigma > 0 ? 0.5 * erfc((u - mu - 0.5) / sigma / sqrt(2)) : 1;
+}
+
+/* Significance level of bench_compare(). */
+#define BENCH_ALPHA    0.01
+
+/*
+ * Compare the registered results with the baseline file `path'. A 
+ * benchmark has regressed when its median is more than `threshold' 
+ * (e.g. 0.03) slower and the slowdown is significant. Returns the 
+ * number of regressions, -1 if the baseline cannot be read.
+ */
+int
+bench_compare(const char *path, double threshold)
+{
+    bench_baseline base[BENCH_MAX], *b;
+    bench_result *r;
+    double median, change, p;
+    int i, j, n, bad = 0;
+
+    if ((n = bench_load(path, base)) < 0)
+	return -1;
+
+    printf("\n%-12s %10s %10s %8s %8s\n", "", "baseline", "current", 
+	   "change", "p");
+
+    for (i = 0; i < bench_count; i++) {
+	r = &bench_registry[i].result;
+
+	for (b = NULL, j = 0; j < n; j++)
+	    if (strcmp(base[j].name, bench_registry[i].name) == 0)
+		b = base + j;
+
+	if (b == NULL || b->samples == 0 || r->samples == 0) {
+	    printf("%-12s %10s\n", bench_registry[i].name, "(new)");
+	    continue;
+	}
+
+	qsort(b->sample, b->samples, sizeof(double), bench_cmp);
+	median = b->sample[b->samples / 2];
+	change = r->median / median - 1;
+	p = bench_mann_whitney(b->sample, b->samples, r->sample, r->samples);
+
+	printf("%-12s %10.2f %10.2f %+7.1f%% %8.4f", bench_registry[i].name, 
+	       median, r->median, change * 100, p);
+	if (change > threshold && p < BENCH_ALPHA) {
+	    printf("  SLOWER");
+	    bad++;
+	}
+	printf("\n");
+    }
+
+    for (i = 0; i < n; i++)
+	free(base[i].sample);
+
+    return bad;
+}
+
 int x = 1000;
 
+/* 
+ * Results go here, so the compiler cannot drop the work. Per thread, 
+ * or the scaling mode would measure false sharing on it.
+ */
+__thread volatile int sink;
+
 void 
 test_pow(void)
 {
     int digits = log(x) - 1;
+    sink = digits;
 }
 
 void
@@ -90,13 +1021,73 @@ test_snprint_strlen(void)
     int digits;
     snprintf(buf, 15, "%d", x);
     digits = strlen(buf);
+    sink = digits;
 }
 
 int 
 main(int argc, char **argv)
 {
 #define TIMES 1000000
+    bench_opts opts = BENCH_DEFAULTS;
+    bench_scaling *sc;
+    const char *json = NULL, *csv = NULL, *baseline = NULL;
+    double threshold = 0.03;
+    int i, nthreads = 0, regressions = 0;
+
     printf("pow: %g\n", timeit(test_pow,TIMES));
     printf("snprintf: %g\n", timeit(test_snprint_strlen,TIMES));
-    return 0;
+
+    /* 
+     * Options: "tsc" times with rdtscp, "perf" collects hardware 
+     * counters, "threads=N" runs the scaling mode up to N threads, 
+     * "json=FILE" and "csv=FILE" save the results, "compare=FILE" 
+     * compares them with a saved run (exit status 2 on regression, 1 
+     * if it cannot be read) and "threshold=PERCENT" sets the slowdown 
+     * tolerated (3%).
+     */
+    for (i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "tsc") == 0)
+	    opts.flags |= BENCH_TSC;
+	else if (strcmp(argv[i], "perf") == 0)
+	    opts.flags |= BENCH_COUNTERS;
+	else if (strncmp(argv[i], "threads=", 8) == 0)
+	    nthreads = atoi(argv[i] + 8);
+	else if (strncmp(argv[i], "json=", 5) == 0)
+	    json = argv[i] + 5;
+	else if (strncmp(argv[i], "csv=", 4) == 0)
+	    csv = argv[i] + 4;
+	else if (strncmp(argv[i], "compare=", 8) == 0)
+	    baseline = argv[i] + 8;
+	else if (strncmp(argv[i], "threshold=", 10) == 0)
+	    threshold = atof(argv[i] + 10) / 100;
+    }
+
+    bench_register("pow", test_pow);
+    bench_register("snprintf", test_snprint_strlen);
+
+    printf("\n");
+    bench_all(&opts);
+
+    if (json && bench_save(json, 1) < 0)
+	fprintf(stderr, "%s: %s\n", json, strerror(errno));
+    if (csv && bench_save(csv, 0) < 0)
+	fprintf(stderr, "%s: %s\n", csv, strerror(errno));
+    if (baseline && (regressions = bench_compare(baseline, threshold)) < 0)
+	fprintf(stderr, "%s: cannot read baseline\n", baseline);
+
+    if (nthreads > 0 && (sc = calloc(nthreads, sizeof(bench_scaling))) != NULL) {
+	if (bench_threads(test_snprint_strlen, &opts, nthreads, sc) == 0) {
+	    printf("\nsnprintf %7s %14s %10s %10s %10s\n", "threads", 
+		   "calls/s", "efficiency", "median", "p99");
+	    for (i = 0; i < nthreads; i++)
+		printf("%16d %14.0f %10.2f %10.2f %10.2f%s\n", sc[i].threads, 
+		       sc[i].throughput, sc[i].efficiency, 
+		       sc[i].latency.median, sc[i].latency.p99, 
+		       sc[i].pinned ? "" : "  (not pinned)");
+	    bench_scaling_free(sc, nthreads);
+	}
+	free(sc);
+    }
+    /* Without a baseline a regression gate must not pass. */
+    return regressions < 0 ? 1 : regressions > 0 ? 2 : 0;
 }
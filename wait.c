@@ -38,25 +38,816 @@
  *
  * I processi zombie sono processi, che per qualsiasi ragione, si sono  
  * conclusi, mentre l'esecuzione del processo padre procede senza saperlo. 
+ *
+ * Tanti figli insieme
+ * -------------------
+ *
+ * wait() attende un figlio alla volta, e mentre si attende non si 
+ * possono leggere le uscite degli altri. Con migliaia di figli serve 
+ * un solo punto di attesa per tutti gli eventi: su Linux pidfd_open() 
+ * restituisce un descrittore che diventa leggibile quando il processo 
+ * termina, e che si puo' quindi registrare in un insieme epoll insieme 
+ * alle pipe di stdout e stderr. Il supervisore che segue attende con 
+ * un'unica epoll_wait(): niente polling e niente thread per figlio.
+ * Un figlio e' concluso quando e' terminato e le sue pipe sono chiuse 
+ * (tutta l'uscita e' stata letta); solo allora si raccoglie lo stato.
+ *
+ * Spostare l'uscita senza copiarla
+ * --------------------------------
+ *
+ * Per inoltrare l'uscita di un figlio a un file, a un socket o a 
+ * un'altra pipe, read() + write() copiano ogni byte due volte fra il 
+ * kernel e il processo. splice() sposta i dati fra una pipe e un altro 
+ * descrittore restando nel kernel, tee() duplica il contenuto di una 
+ * pipe in un'altra senza consumarlo, vmsplice() inserisce in una pipe 
+ * le pagine di un buffer del processo. Non tutti i descrittori li 
+ * accettano (ad esempio i file aperti con O_APPEND): in quel caso 
+ * (EINVAL) si torna a read() + write().
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>		/* per exit() */
 #include <unistd.h>		/* per fork(), getpid(), getppid() */
 #include <string.h>		/* per strerror() */
 #include <errno.h>		/* per errno */
+#include <fcntl.h>		/* per O_CLOEXEC */
+#include <spawn.h>		/* per posix_spawnp() */
 #include <sys/types.h>		/* per pid_t */
+#include <sys/epoll.h>		/* per epoll_wait() */
+#include <sys/resource.h>	/* per setrlimit() */
+#include <sys/stat.h>		/* per fstat() */
+#include <sys/uio.h>		/* per vmsplice() */
+#include <sys/syscall.h>	/* per pidfd_open() */
 
 #include <sys/wait.h>		/* per wait() */
 
+#ifndef SYS_pidfd_open
+# define SYS_pidfd_open 434
+#endif
+
+/* Eventi per epoll_wait() e lunghezza delle letture dalle pipe */
+#define SV_EVENTS      64
+#define SV_BUF         4096
+
+/* 
+ * Tipo di descrittore, nei 3 bit bassi del dato epoll: SV_WRITABLE | 
+ * SV_OUT (o SV_ERR) e' la destinazione dell'inoltro, attesa scrivibile.
+ */
+#define SV_PIDFD       0
+#define SV_OUT         1
+#define SV_ERR         2
+#define SV_WRITABLE    4
+#define SV_SHIFT       3
+
+/* sv_forward(): la destinazione e' piena, si riprova quando si svuota */
+#define SV_BLOCKED     (-2)
+
+/* Byte spostati al piu' da una chiamata */
+#define PLUMB_CHUNK    (64 * 1024)
+
+/* Modo di plumb(): si parte da splice(), si ripiega sulla copia */
+#define PLUMB_SPLICE   0
+#define PLUMB_COPY     1
+
+static int
+plumb_ispipe(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* Scrive tutti i `len' byte di `buf'. */
+static int
+plumb_writeall(int out, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = write(out, buf, len)) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+/* 
+ * Sposta fino a `len' byte da `in' a `out' (uno dei due e' una pipe). 
+ * `*mode' (inizialmente PLUMB_SPLICE) diventa PLUMB_COPY se i 
+ * descrittori non accettano splice(). Ritorna i byte spostati, 0 alla 
+ * fine dei dati, -1 in caso di errore.
+ */
+ssize_t
+plumb(int in, int out, size_t len, int *mode)
+{
+    char buf[PLUMB_CHUNK];
+    ssize_t n;
+
+    if (len > PLUMB_CHUNK)
+	len = PLUMB_CHUNK;
+
+    while (*mode == PLUMB_SPLICE) {
+	if ((n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE)) >= 0)
+	    return n;
+	if (errno == EINVAL || errno == ENOSYS)
+	    *mode = PLUMB_COPY;
+	else if (errno != EINTR)
+	    return -1;
+    }
+
+    while ((n = read(in, buf, len)) == -1)
+	if (errno != EINTR)
+	    return -1;
+
+    if (n > 0 && plumb_writeall(out, buf, n) == -1)
+	return -1;
+
+    return n;
+}
+
+/* Sposta esattamente `len' byte (gia' presenti in `in'). */
+static int
+plumb_exact(int in, int out, size_t len, int *mode)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = plumb(in, out, len, mode)) <= 0)
+	    return -1;
+	len -= n;
+    }
+
+    return 0;
+}
+
+/* 
+ * Sposta tutto da `in' a `out' fino alla fine dei dati. Se nessuno dei 
+ * due e' una pipe i dati passano da una pipe intermedia. Ritorna -1 in 
+ * caso di errore.
+ */
+int
+plumb_all(int in, int out)
+{
+    int p[2], mode = PLUMB_SPLICE, mid = PLUMB_SPLICE, r = 0;
+    ssize_t n;
+
+    if (plumb_ispipe(in) || plumb_ispipe(out)) {
+	while ((n = plumb(in, out, PLUMB_CHUNK, &mode)) > 0)
+	    ;
+	return n == 0 ? 0 : -1;
+    }
+
+    if (pipe2(p, O_CLOEXEC) == -1)
+	return -1;
+
+    while ((n = plumb(in, p[1], PLUMB_CHUNK, &mode)) > 0)
+	if ((r = plumb_exact(p[0], out, n, &mid)) == -1)
+	    break;
+
+    close(p[0]);
+    close(p[1]);
+    return n == 0 && r == 0 ? 0 : -1;
+}
+
+/* 
+ * Come plumb_all(), ma i dati della pipe `in' vanno sia a `out' sia a 
+ * `copy': tee() li duplica (in `copy' stessa se e' una pipe, altrimenti 
+ * in una pipe intermedia) prima che splice() li consumi.
+ */
+int
+plumb_tee(int in, int out, int copy)
+{
+    int p[2] = { -1, -1 }, m1 = PLUMB_SPLICE, m2 = PLUMB_SPLICE, r = 0;
+    int dst = copy;
+    ssize_t n;
+
+    if (!plumb_ispipe(copy)) {
+	if (pipe2(p, O_CLOEXEC) == -1)
+	    return -1;
+	dst = p[1];
+    }
+
+    for (;;) {
+	if ((n = tee(in, dst, PLUMB_CHUNK, 0)) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    r = -1;
+	    break;
+	}
+	/* Pipe vuota e senza scrittori: fine dei dati */
+	if (n == 0)
+	    break;
+
+	if ((dst != copy && plumb_exact(p[0], copy, n, &m2) == -1)
+	    || plumb_exact(in, out, n, &m1) == -1) {
+	    r = -1;
+	    break;
+	}
+    }
+
+    if (p[0] != -1) {
+	close(p[0]);
+	close(p[1]);
+    }
+    return r;
+}
+
+/* 
+ * Scrive `buf' nella pipe `out' con vmsplice(): le pagine del buffer 
+ * sono date alla pipe senza copia, quindi `buf' non va modificato 
+ * finche' il lettore non le ha consumate. Se `out' non e' una pipe si 
+ * usa write(). Ritorna -1 in caso di errore.
+ */
 int
-main(void)
+plumb_write(int out, const void *buf, size_t len)
+{
+    struct iovec iov = { (void *) buf, len };
+    ssize_t n;
+
+    while (iov.iov_len > 0) {
+	if ((n = vmsplice(out, &iov, 1, 0)) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EBADF || errno == EINVAL)
+		return plumb_writeall(out, iov.iov_base, iov.iov_len);
+	    return -1;
+	}
+	iov.iov_base = (char *) iov.iov_base + n;
+	iov.iov_len -= n;
+    }
+
+    return 0;
+}
+
+typedef struct _sv_child sv_child;
+
+struct _sv_child {
+    pid_t pid;			/* 0 se il posto e' libero */
+    int pidfd;			/* -1 dopo la terminazione */
+    int fd[3];			/* fd[SV_OUT], fd[SV_ERR]: -1 se chiuse */
+    int dst[3];			/* inoltro, -1 se nessuno */
+    int mode[3];
+    int wfd[3];			/* dup() di dst[] attesa scrivibile, o -1 */
+    char *pend[3];		/* copia: letti e non ancora scritti */
+    size_t poff[3], plen[3];
+    int error[3];		/* errno dell'inoltro fallito, 0 se nessuno */
+    void *arg;
+};
+
+typedef struct _supervisor supervisor;
+
+/* Uscita del figlio: `fd' e' 1 (stdout) o 2 (stderr) */
+typedef void (*sv_output_fn)(supervisor *s, sv_child *c, int fd, 
+			     const char *buf, size_t len);
+
+/* Figlio concluso: `status' e' quello di waitpid() */
+typedef void (*sv_exit_fn)(supervisor *s, sv_child *c, int status);
+
+struct _supervisor {
+    int ep;			/* insieme epoll */
+    sv_child **child;		/* allocati uno per uno: non si spostano */
+    int n;			/* posti in child[] */
+    int live;			/* figli non ancora conclusi */
+    sv_output_fn output;
+    sv_exit_fn exit;
+    void *arg;
+};
+
+supervisor *
+sv_new(sv_output_fn output, sv_exit_fn exit, void *arg)
+{
+    supervisor *s;
+
+    if ((s = calloc(1, sizeof(supervisor))) == NULL)
+	return NULL;
+
+    if ((s->ep = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+	free(s);
+	return NULL;
+    }
+
+    s->output = output;
+    s->exit = exit;
+    s->arg = arg;
+    return s;
+}
+
+/* Attende gli eventi di `fd' con (indice del figlio, tipo) come dato. */
+static int
+sv_watch(supervisor *s, int op, int fd, uint32_t events, int i, int type)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.u64 = (uint64_t) i << SV_SHIFT | type;
+    return epoll_ctl(s->ep, op, fd, &ev);
+}
+
+static void
+sv_close(supervisor *s, int fd)
+{
+    epoll_ctl(s->ep, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+/* 
+ * Lancia `argv' (cercato nel PATH) con stdout e stderr su due pipe. 
+ * `arg' e' a disposizione del chiamante. Ritorna NULL (con errno) in 
+ * caso di errore. Il puntatore resta valido fino a exit().
+ */
+sv_child *
+sv_spawn(supervisor *s, char *const argv[], void *arg)
+{
+    posix_spawn_file_actions_t fa;
+    int out[2] = { -1, -1 }, err[2] = { -1, -1 }, i, r;
+    sv_child *c;
+    pid_t pid;
+
+    for (i = 0; i < s->n && s->child[i] && s->child[i]->pid; i++)
+	;
+    if (i == s->n) {
+	int n = s->n ? s->n * 2 : 16;
+	sv_child **v;
+
+	if ((v = realloc(s->child, n * sizeof(sv_child *))) == NULL)
+	    return NULL;
+	memset(v + s->n, 0, (n - s->n) * sizeof(sv_child *));
+	s->child = v;
+	s->n = n;
+    }
+    if (s->child[i] == NULL && (s->child[i] = calloc(1, sizeof(sv_child))) == NULL)
+	return NULL;
+    c = s->child[i];
+
+    if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1)
+	goto fail;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+    posix_spawn_file_actions_adddup2(&fa, err[1], 2);
+    r = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (r != 0) {
+	errno = r;
+	goto fail;
+    }
+
+    close(out[1]);
+    close(err[1]);
+    c->pid = pid;
+    c->fd[SV_OUT] = out[0];
+    c->fd[SV_ERR] = err[0];
+    c->dst[SV_OUT] = c->dst[SV_ERR] = -1;
+    c->mode[SV_OUT] = c->mode[SV_ERR] = PLUMB_SPLICE;
+    c->wfd[SV_OUT] = c->wfd[SV_ERR] = -1;
+    c->error[SV_OUT] = c->error[SV_ERR] = 0;
+    c->arg = arg;
+
+    if ((c->pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1
+	|| sv_watch(s, EPOLL_CTL_ADD, c->pidfd, EPOLLIN, i, SV_PIDFD) == -1
+	|| sv_watch(s, EPOLL_CTL_ADD, out[0], EPOLLIN, i, SV_OUT) == -1
+	|| sv_watch(s, EPOLL_CTL_ADD, err[0], EPOLLIN, i, SV_ERR) == -1) {
+	/* Senza pidfd il figlio non sarebbe mai raccolto */
+	r = errno;
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	if (c->pidfd != -1)
+	    sv_close(s, c->pidfd);
+	sv_close(s, out[0]);
+	sv_close(s, err[0]);
+	c->pid = 0;
+	errno = r;
+	return NULL;
+    }
+
+    s->live++;
+    return c;
+
+  fail:
+    r = errno;
+    for (i = 0; i < 2; i++) {
+	if (out[i] != -1)
+	    close(out[i]);
+	if (err[i] != -1)
+	    close(err[i]);
+    }
+    errno = r;
+    return NULL;
+}
+
+/* 
+ * L'uscita di `c' va direttamente a `out' e `err' (-1 per lasciarla 
+ * alla funzione di uscita del supervisore), senza copie se possibile. 
+ * Perche' una destinazione piena non fermi il supervisore (e tutti gli 
+ * altri figli), `out' e `err' diventano O_NONBLOCK: SPLICE_F_NONBLOCK 
+ * vale solo per il lato pipe di splice(), e la copia usa write(). Il 
+ * flag e' della descrizione del file aperto, condivisa con i dup() e 
+ * con gli altri processi (es. il terminale): chi lo usa ancora dopo 
+ * sv_run() deve ripristinarlo. Un inoltro fallito chiude la pipe del 
+ * figlio e lascia l'errno in c->error[SV_OUT] o c->error[SV_ERR]; per 
+ * avere EPIPE invece di SIGPIPE quando chi legge la destinazione la 
+ * chiude, SIGPIPE va ignorato. Ritorna -1 (con errno) se fcntl() 
+ * fallisce.
+ */
+int
+sv_redirect(sv_child *c, int out, int err)
+{
+    int fd[3] = { -1, out, err }, i, fl;
+
+    for (i = SV_OUT; i <= SV_ERR; i++)
+	if (fd[i] != -1 && ((fl = fcntl(fd[i], F_GETFL)) == -1
+			    || fcntl(fd[i], F_SETFL, fl | O_NONBLOCK) == -1))
+	    return -1;
+
+    c->dst[SV_OUT] = out;
+    c->dst[SV_ERR] = err;
+    return 0;
+}
+
+/* Scrive quanto resta in c->pend[type]: 0, SV_BLOCKED o -1. */
+static ssize_t
+sv_flush(sv_child *c, int type)
+{
+    ssize_t w;
+
+    while (c->poff[type] < c->plen[type])
+	if ((w = write(c->dst[type], c->pend[type] + c->poff[type], 
+		       c->plen[type] - c->poff[type])) >= 0)
+	    c->poff[type] += w;
+	else if (errno == EAGAIN)
+	    return SV_BLOCKED;
+	else if (errno != EINTR)
+	    return -1;
+
+    return 0;
+}
+
+/* 
+ * Sposta in modo non bloccante da c->fd[type] a c->dst[type]. Ritorna 
+ * i byte letti, 0 alla fine dei dati, SV_BLOCKED se la destinazione e' 
+ * piena (con la copia, i byte rimasti sono in c->pend[type]), -1 in 
+ * caso di errore.
+ */
+static ssize_t
+sv_forward(sv_child *c, int type)
+{
+    ssize_t n, w;
+
+    while (c->mode[type] == PLUMB_SPLICE) {
+	if ((n = splice(c->fd[type], NULL, c->dst[type], NULL, PLUMB_CHUNK,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) >= 0)
+	    return n;
+	/* La sorgente e' leggibile: EAGAIN viene dalla destinazione */
+	if (errno == EAGAIN)
+	    return SV_BLOCKED;
+	if (errno == EINVAL || errno == ENOSYS)
+	    c->mode[type] = PLUMB_COPY;
+	else if (errno != EINTR)
+	    return -1;
+    }
+
+    if (c->pend[type] == NULL 
+	&& (c->pend[type] = malloc(PLUMB_CHUNK)) == NULL)
+	return -1;
+
+    while ((n = read(c->fd[type], c->pend[type], PLUMB_CHUNK)) == -1)
+	if (errno != EINTR)
+	    return -1;
+
+    c->poff[type] = 0;
+    c->plen[type] = n;
+    if ((w = sv_flush(c, type)) < 0)
+	return w;
+
+    return n;
+}
+
+/* 
+ * Smette di leggere c->fd[type] finche' la destinazione non e' 
+ * scrivibile. La si attende con una dup(): lo stesso descrittore (es. 
+ * il nostro stdout) puo' essere la destinazione di piu' figli, ma non 
+ * entrare due volte nell'insieme epoll.
+ */
+static int
+sv_block(supervisor *s, sv_child *c, int i, int type)
+{
+    if (sv_watch(s, EPOLL_CTL_MOD, c->fd[type], 0, i, type) == -1
+	|| (c->wfd[type] = fcntl(c->dst[type], F_DUPFD_CLOEXEC, 0)) == -1)
+	return -1;
+
+    if (sv_watch(s, EPOLL_CTL_ADD, c->wfd[type], EPOLLOUT, i, 
+		 SV_WRITABLE | type) == -1) {
+	close(c->wfd[type]);
+	c->wfd[type] = -1;
+	return -1;
+    }
+
+    return 0;
+}
+
+static int
+sv_unblock(supervisor *s, sv_child *c, int i, int type)
+{
+    sv_close(s, c->wfd[type]);
+    c->wfd[type] = -1;
+    return sv_watch(s, EPOLL_CTL_MOD, c->fd[type], EPOLLIN, i, type);
+}
+
+/* Chiude la pipe c->fd[type] e quanto serviva per inoltrarla. */
+static void
+sv_drop(supervisor *s, sv_child *c, int type)
+{
+    sv_close(s, c->fd[type]);
+    c->fd[type] = -1;
+    if (c->wfd[type] != -1) {
+	sv_close(s, c->wfd[type]);
+	c->wfd[type] = -1;
+    }
+    free(c->pend[type]);
+    c->pend[type] = NULL;
+    c->poff[type] = c->plen[type] = 0;
+}
+
+/* Il figlio e' concluso se e' terminato e ha chiuso le pipe. */
+static void
+sv_check(supervisor *s, sv_child *c)
+{
+    int status;
+
+    if (c->pidfd != -1 || c->fd[SV_OUT] != -1 || c->fd[SV_ERR] != -1)
+	return;
+
+    /* Il pidfd era leggibile: waitpid() non si blocca */
+    if (waitpid(c->pid, &status, 0) == -1)
+	status = 0;
+
+    /* 
+     * Il posto si libera solo dopo exit(): se lancia un altro figlio 
+     * (per tenerne N in esecuzione) questo ne prende un altro.
+     */
+    s->live--;
+    if (s->exit)
+	s->exit(s, c, status);
+    c->pid = 0;
+}
+
+/* 
+ * Gestisce gli eventi finche' tutti i figli non sono conclusi. 
+ * Ritorna -1 in caso di errore.
+ */
+int
+sv_run(supervisor *s)
+{
+    struct epoll_event ev[SV_EVENTS];
+    char buf[SV_BUF];
+    sv_child *c;
+    int i, j, k, type;
+    ssize_t len;
+
+    while (s->live > 0) {
+	if ((k = epoll_wait(s->ep, ev, SV_EVENTS, -1)) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	for (i = 0; i < k; i++) {
+	    j = ev[i].data.u64 >> SV_SHIFT;
+	    c = s->child[j];
+	    type = ev[i].data.u64 & ((1 << SV_SHIFT) - 1);
+
+	    if (type == SV_PIDFD) {
+		sv_close(s, c->pidfd);
+		c->pidfd = -1;
+	    } else if (type & SV_WRITABLE) {
+		type &= ~SV_WRITABLE;
+		/* Evento rimasto da una pipe chiusa in questo giro */
+		if (c->wfd[type] == -1)
+		    continue;
+		if ((len = sv_flush(c, type)) == SV_BLOCKED)
+		    continue;
+		if (len == 0 && sv_unblock(s, c, j, type) == 0)
+		    continue;
+		c->error[type] = errno;
+		sv_drop(s, c, type);
+	    } else if (c->dst[type] != -1) {
+		/* Sorgente sospesa dopo che l'evento era stato raccolto */
+		if (c->wfd[type] != -1)
+		    continue;
+		if ((len = sv_forward(c, type)) > 0)
+		    continue;
+		if (len == SV_BLOCKED && sv_block(s, c, j, type) == 0)
+		    continue;
+		if (len != 0)
+		    c->error[type] = errno;
+		sv_drop(s, c, type);
+	    } else if ((len = read(c->fd[type], buf, sizeof(buf))) > 0) {
+		if (s->output)
+		    s->output(s, c, type, buf, len);
+		continue;
+	    } else if (len == -1 && errno == EINTR) {
+		continue;
+	    } else {
+		sv_drop(s, c, type);
+	    }
+
+	    sv_check(s, c);
+	}
+    }
+
+    return 0;
+}
+
+/* I figli devono essere conclusi (sv_run()). */
+void
+sv_free(supervisor *s)
+{
+    int i;
+
+    close(s->ep);
+    for (i = 0; i < s->n; i++)
+	free(s->child[i]);
+    free(s->child);
+    free(s);
+}
+
+/* Come in exec.c: decodifica dello stato di uscita */
+static void
+sv_report(supervisor *s, sv_child *c, int status)
+{
+    int *count = s->arg;
+
+    count[0]++;
+    if (WIFEXITED(status)) {
+	count[1] += WEXITSTATUS(status) != 0;
+	if (c->arg)
+	    printf("PID %ld: Exited: $? = %d\n", (long) c->pid,
+		   WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+	count[2]++;
+	if (c->arg)
+	    printf("PID %ld: Signal: %d%s\n", (long) c->pid,
+		   WTERMSIG(status), WCOREDUMP(status)
+		   ? " with core file." : "");
+    } else {
+	printf("Stopped.\n");
+    }
+}
+
+static void
+sv_print(supervisor *s, sv_child *c, int fd, const char *buf, size_t len)
+{
+    (void) s;
+    if (c->arg)
+	printf("PID %ld %s: %.*s", (long) c->pid, fd == SV_OUT ? "stdout" 
+	       : "stderr", (int) len, buf);
+}
+
+/* 
+ * "wait sv [N]": N figli insieme, ognuno scrive su stdout e stderr, 
+ * dorme un po' e termina con stati diversi (alcuni per un segnale). 
+ * Con N <= 10 si stampa tutto, altrimenti solo il riepilogo.
+ */
+static int
+sv_demo(int n)
+{
+    static char *argv[] = { "sh", "-c", "echo out $$; echo err >&2; "
+	"sleep 0.$(($$ % 5)); case $(($$ % 4)) in 0) exit 0;; "
+	"1) exit 3;; 2) kill -TERM $$;; 3) kill -SEGV $$;; esac", NULL };
+    int count[3] = { 0, 0, 0 }, i;
+    struct rlimit rl;
+    supervisor *s;
+
+    /* Tre descrittori per figlio */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((s = sv_new(sv_print, sv_report, count)) == NULL) {
+	fprintf(stderr, "%s: sv_new()\n", strerror(errno));
+	return 1;
+    }
+
+    for (i = 0; i < n; i++)
+	if (sv_spawn(s, argv, n <= 10 ? s : NULL) == NULL) {
+	    fprintf(stderr, "%s: sv_spawn()\n", strerror(errno));
+	    break;
+	}
+
+    sv_run(s);
+    sv_free(s);
+
+    printf("%d children: %d exited with failure, %d signaled\n", 
+	   count[0], count[1], count[2]);
+    return 0;
+}
+
+static void
+plumb_exit(supervisor *s, sv_child *c, int status)
+{
+    if (c->error[SV_OUT])
+	fprintf(stderr, "%s: stdout\n", strerror(c->error[SV_OUT]));
+    if (c->error[SV_ERR])
+	fprintf(stderr, "%s: stderr\n", strerror(c->error[SV_ERR]));
+    *(int *) s->arg = status;
+}
+
+/* 
+ * "wait plumb [-c] [-t FILE] CMD [ARG...]": esegue CMD e ne inoltra 
+ * stdout e stderr ai nostri con splice() (-c: con read() + write(), 
+ * per confronto). Con -t l'uscita va anche in FILE, con tee().
+ */
+static int
+plumb_demo(int argc, char **argv)
+{
+    int i = 0, copy = 0, fd = -1, p[2], status = 0, fl[3];
+    posix_spawn_file_actions_t fa;
+    supervisor *s;
+    sv_child *c;
+    pid_t pid;
+
+    for (; i < argc && argv[i][0] == '-'; i++)
+	if (strcmp(argv[i], "-c") == 0)
+	    copy = 1;
+	else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc
+		 && (fd = open(argv[++i], O_WRONLY | O_CREAT | O_TRUNC 
+			       | O_CLOEXEC, 0644)) == -1) {
+	    fprintf(stderr, "%s: %s\n", strerror(errno), argv[i]);
+	    return 1;
+	}
+
+    if (i == argc) {
+	fprintf(stderr, "usage: wait plumb [-c] [-t FILE] CMD [ARG...]\n");
+	return 1;
+    }
+
+    if (fd != -1) {
+	/* Solo stdout passa dalla pipe, stderr resta il nostro */
+	if (pipe2(p, O_CLOEXEC) == -1)
+	    return 1;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, p[1], 1);
+	i = posix_spawnp(&pid, argv[i], &fa, NULL, argv + i, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(p[1]);
+	if (i != 0) {
+	    fprintf(stderr, "%s: posix_spawnp()\n", strerror(i));
+	    return 1;
+	}
+	if (plumb_tee(p[0], 1, fd) == -1)
+	    fprintf(stderr, "%s: plumb_tee()\n", strerror(errno));
+	close(p[0]);
+	close(fd);
+	waitpid(pid, &status, 0);
+    } else {
+	if ((s = sv_new(NULL, plumb_exit, &status)) == NULL
+	    || (c = sv_spawn(s, argv + i, NULL)) == NULL) {
+	    fprintf(stderr, "%s: sv_spawn()\n", strerror(errno));
+	    return 1;
+	}
+	/* Se chi legge il nostro stdout lo chiude, EPIPE in c->error[] */
+	signal(SIGPIPE, SIG_IGN);
+	/* Stdout e stderr sono anche della shell: si rimettono come erano */
+	fl[1] = fcntl(1, F_GETFL);
+	fl[2] = fcntl(2, F_GETFL);
+	if (sv_redirect(c, 1, 2) == -1) {
+	    fprintf(stderr, "%s: sv_redirect()\n", strerror(errno));
+	    kill(c->pid, SIGKILL);
+	    sv_redirect(c, -1, -1);
+	}
+	if (copy)
+	    c->mode[SV_OUT] = c->mode[SV_ERR] = PLUMB_COPY;
+	sv_run(s);
+	sv_free(s);
+	for (i = 1; i <= 2; i++)
+	    if (fl[i] != -1)
+		fcntl(i, F_SETFL, fl[i]);
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int
+main(int argc, char **argv)
 {
     pid_t pid;		/* PID del processo figlio */
     pid_t wpid;		/* PID ritornato da wait() */
     int status;		/* Valore di uscita del figlio wait() */
     int sts;
 
+    if (argc > 1 && strcmp(argv[1], "sv") == 0)
+	return sv_demo(argc > 2 ? atoi(argv[2]) : 10);
+
+    if (argc > 1 && strcmp(argv[1], "plumb") == 0)
+	return plumb_demo(argc - 2, argv + 2);
+
     /* Crea un nuovo processo figlio */
     pid = fork();		
 
@@ -85,6 +876,7 @@ main(void)
 	} else {
 	    printf("Child PID %ld exited status %d\n",
 		   (long) pid, status);
+	    sts = 0;
 	}
     }
 